@@ -0,0 +1,358 @@
+#include "kthreadpool.hpp"
+#include <iostream>
+#include <cmath>
+#include <cstring>
+#include <string>
+#include <sstream>
+
+// microbenchmarks for the pool itself, every result is written as one JSON object per line
+//    so runs can be collected and compared across commits
+// usage: kthread_bench [--threads maxThreads] [--reps repetitions] [--filter name]
+
+typedef std::chrono::steady_clock BenchClock;
+
+struct BenchSettings
+{
+	int MaxThreads = 0;
+	int Reps = 5;
+	const char* Filter = nullptr;
+};
+
+BenchSettings Settings;
+
+void Report(const char* bench, const std::string& params, const char* metric, double value)
+{
+	std::cout << "{\"bench\":\"" << bench << "\"" << params << ",\"metric\":\"" << metric << "\",\"value\":" << value << "}\n";
+}
+
+std::string Param(const char* name, double value)
+{
+	std::ostringstream stream;
+	stream.precision(15);
+	stream << ",\"" << name << "\":" << value;
+	return stream.str();
+}
+
+std::string Param(const char* name, const char* value)
+{
+	return std::string(",\"") + name + "\":\"" + value + "\"";
+}
+
+bool ShouldRun(const char* bench)
+{
+	return !Settings.Filter || std::strstr(bench, Settings.Filter) != nullptr;
+}
+
+// median of Settings.Reps runs of func, in seconds
+template <typename Functor>
+double Measure(Functor func)
+{
+	std::vector<double> times;
+	for (int i = 0; i < Settings.Reps; i++)
+	{
+		const BenchClock::time_point start = BenchClock::now();
+		func();
+		times.push_back(std::chrono::duration<double>(BenchClock::now() - start).count());
+	}
+
+	std::sort(times.begin(), times.end());
+	return times[times.size() / 2];
+}
+
+double Percentile(std::vector<double>& values, double fraction)
+{
+	std::sort(values.begin(), values.end());
+	return values[(size_t)(fraction * (values.size() - 1))];
+}
+
+// thread counts to sweep, powers of two up to the limit and the limit itself
+std::vector<int> GetThreadCounts()
+{
+	std::vector<int> counts;
+	for (int count = 1; count < Settings.MaxThreads; count *= 2)
+		counts.push_back(count);
+
+	counts.push_back(Settings.MaxThreads);
+	return counts;
+}
+
+// cpu bound work that the compiler can't drop, cost grows with iterations
+float Kernel(float value, int iterations)
+{
+	for (int i = 0; i < iterations; i++)
+		value = std::sqrt(value * value + 1.0f) * 0.5f;
+
+	return value;
+}
+
+void Bench_EmptyJobs()
+{
+	const int jobCount = 100000;
+	const auto empty = []() -> void {};
+
+	for (int threads : GetThreadCounts())
+	{
+		KThreadPool pool(threads);
+		const std::string params = Param("threads", threads);
+
+		const double single = Measure([&]() -> void
+		{
+			for (int i = 0; i < jobCount; i++)
+				pool.AddFunctionToPool(empty);
+
+			pool.WaitForFinish();
+		});
+		Report("empty_jobs", params + Param("submit", "single"), "ns_per_job", single * 1e9 / jobCount);
+
+		std::vector<int> items(jobCount);
+		const double batch = Measure([&]() -> void
+		{
+			pool.AddFunctionsToPool([](int) -> void {}, items);
+			pool.WaitForFinish();
+		});
+		Report("empty_jobs", params + Param("submit", "batch"), "ns_per_job", batch * 1e9 / jobCount);
+
+		// jobs added from inside jobs go to the worker's own deque
+		const int parentCount = 100;
+		const int childCount = jobCount / parentCount;
+		const double nested = Measure([&]() -> void
+		{
+			for (int i = 0; i < parentCount; i++)
+			{
+				pool.AddFunctionToPool([&pool, empty, childCount]() -> void
+				{
+					for (int j = 0; j < childCount; j++)
+						pool.AddFunctionToPool(empty);
+				});
+			}
+
+			pool.WaitForFinish();
+		});
+		Report("empty_jobs", params + Param("submit", "nested"), "ns_per_job", nested * 1e9 / jobCount);
+	}
+}
+
+void Bench_Latency()
+{
+	const int sampleCount = 2000;
+
+	for (int threads : GetThreadCounts())
+	{
+		KThreadPool pool(threads);
+
+		// idle pool, every job has to wake a thread, busy pool, threads are already looking for work
+		for (int bBusy = 0; bBusy < 2; bBusy++)
+		{
+			std::vector<double> latencies(sampleCount);
+			std::atomic<bool> bStop { false };
+
+			if (bBusy)
+			{
+				for (int i = 0; i < threads - 1; i++)
+				{
+					pool.AddFunctionToPool(KThreadPool::EJobPriority::Background, [&bStop]() -> void
+					{
+						while (!bStop)
+							std::this_thread::yield();
+					});
+				}
+			}
+
+			for (int i = 0; i < sampleCount; i++)
+			{
+				KThreadPool::Future<double> latency = pool.Submit(KThreadPool::EJobPriority::High, [](BenchClock::time_point queued) -> double
+				{
+					return std::chrono::duration<double>(BenchClock::now() - queued).count();
+				}, BenchClock::now());
+
+				latencies[i] = latency.Get();
+
+				// let the pool go back to sleep between samples
+				if (!bBusy) std::this_thread::sleep_for(std::chrono::microseconds(100));
+			}
+
+			bStop = true;
+			pool.WaitForFinish();
+
+			const std::string params = Param("threads", threads) + Param("pool", bBusy ? "busy" : "idle");
+			Report("latency", params, "p50_ns", Percentile(latencies, 0.5) * 1e9);
+			Report("latency", params, "p90_ns", Percentile(latencies, 0.9) * 1e9);
+			Report("latency", params, "p99_ns", Percentile(latencies, 0.99) * 1e9);
+			Report("latency", params, "max_ns", Percentile(latencies, 1.0) * 1e9);
+		}
+	}
+}
+
+void Bench_IterateScaling()
+{
+	const int iterations = 50;
+	const auto kernel = [](float* value) -> void
+	{
+		*value = Kernel(*value, iterations);
+	};
+
+	const KThreadPool::EPartition partitions[] = { KThreadPool::EPartition::Static, KThreadPool::EPartition::Guided, KThreadPool::EPartition::Dynamic };
+	const char* partitionNames[] = { "static", "guided", "dynamic" };
+
+	for (size_t elementCount : { 1000, 10000, 100000, 1000000 })
+	{
+		std::vector<float> values(elementCount, 1.0f);
+
+		double serial = Measure([&]() -> void
+		{
+			for (float& value : values)
+				kernel(&value);
+		});
+		Report("iterate", Param("elements", (double)elementCount) + Param("threads", 1) + Param("partition", "serial"), "ns_per_element", serial * 1e9 / elementCount);
+
+		for (int threads : GetThreadCounts())
+		{
+			KThreadPool pool(threads);
+
+			for (size_t p = 0; p < std::size(partitions); p++)
+			{
+				const double time = Measure([&]() -> void
+				{
+					pool.ParallelFor(kernel, { .Partition = partitions[p] }, values);
+				});
+
+				const std::string params = Param("elements", (double)elementCount) + Param("threads", threads) + Param("partition", partitionNames[p]);
+				Report("iterate", params, "ns_per_element", time * 1e9 / elementCount);
+				Report("iterate", params, "speedup", serial / time);
+			}
+		}
+	}
+}
+
+void Bench_WeightedImbalance()
+{
+	const size_t elementCount = 20000;
+	std::vector<int> costs(elementCount);
+
+	// linear ramp, a few very heavy elements at the end, and random spikes
+	const char* shapes[] = { "ramp", "tail", "spikes" };
+	for (size_t shape = 0; shape < std::size(shapes); shape++)
+	{
+		for (size_t i = 0; i < elementCount; i++)
+		{
+			if (shape == 0) costs[i] = 1 + (int)(i * 200 / elementCount);
+			else if (shape == 1) costs[i] = i >= elementCount - 16 ? 5000 : 20;
+			else costs[i] = (i * 2654435761u) % 64 == 0 ? 1500 : 20;
+		}
+
+		const auto work = [](int* cost) -> void
+		{
+			volatile float sink = Kernel(1.0f, *cost);
+			(void)sink;
+		};
+		const auto weight = [](const int* cost) -> double { return *cost; };
+
+		const double serial = Measure([&]() -> void
+		{
+			for (int& cost : costs)
+				work(&cost);
+		});
+
+		for (int threads : GetThreadCounts())
+		{
+			if (threads == 1) continue;
+
+			KThreadPool pool(threads);
+			const std::string params = Param("shape", shapes[shape]) + Param("threads", threads);
+
+			// how close each run gets to a perfect split of the serial time
+			const double ideal = serial / threads;
+
+			const double staticTime = Measure([&]() -> void { pool.ParallelFor(work, { .Partition = KThreadPool::EPartition::Static }, costs); });
+			Report("weighted", params + Param("mode", "static"), "efficiency", ideal / staticTime);
+
+			const double dynamicTime = Measure([&]() -> void { pool.ParallelFor(work, costs); });
+			Report("weighted", params + Param("mode", "dynamic"), "efficiency", ideal / dynamicTime);
+
+			const double weightedTime = Measure([&]() -> void { pool.ParallelForWeighted(work, weight, costs); });
+			Report("weighted", params + Param("mode", "weighted"), "efficiency", ideal / weightedTime);
+
+			// weights that are all equal, corrected by the profile over the repetitions
+			KThreadPool::WeightProfile profile;
+			const auto flat = [](const int*) -> double { return 1.0; };
+			for (int i = 0; i < 8; i++)
+				pool.ParallelForWeighted(work, flat, { .Profile = &profile }, costs);
+
+			const double profiledTime = Measure([&]() -> void { pool.ParallelForWeighted(work, flat, { .Profile = &profile }, costs); });
+			Report("weighted", params + Param("mode", "profiled"), "efficiency", ideal / profiledTime);
+		}
+	}
+}
+
+void Bench_Contention()
+{
+	const int jobsPerSubmitter = 20000;
+	const int threads = Settings.MaxThreads;
+	KThreadPool pool(threads);
+
+	for (int submitters : { 1, 2, 4, 8 })
+	{
+		const double time = Measure([&]() -> void
+		{
+			std::vector<std::thread> threadList;
+			for (int s = 0; s < submitters; s++)
+			{
+				threadList.push_back(std::thread([&pool]() -> void
+				{
+					for (int i = 0; i < jobsPerSubmitter; i++)
+						pool.AddFunctionToPool([]() -> void {});
+				}));
+			}
+
+			for (std::thread& thread : threadList)
+				thread.join();
+
+			pool.WaitForFinish();
+		});
+
+		Report("contention", Param("threads", threads) + Param("submitters", submitters), "ns_per_job", time * 1e9 / (submitters * jobsPerSubmitter));
+	}
+}
+
+int main(int argc, char** argv)
+{
+	for (int i = 1; i + 1 < argc; i += 2)
+	{
+		if (std::strcmp(argv[i], "--threads") == 0) Settings.MaxThreads = std::atoi(argv[i + 1]);
+		else if (std::strcmp(argv[i], "--reps") == 0) Settings.Reps = std::atoi(argv[i + 1]);
+		else if (std::strcmp(argv[i], "--filter") == 0) Settings.Filter = argv[i + 1];
+	}
+
+	if (Settings.MaxThreads <= 0) Settings.MaxThreads = KThreadPool::GetAvailableCpuCount();
+	if (Settings.Reps <= 0) Settings.Reps = 1;
+
+#ifdef NDEBUG
+	const bool bOptimized = true;
+#else
+	const bool bOptimized = false;
+#endif
+
+#ifdef KTHREADPOOL_STATS
+	const bool bStats = true;
+#else
+	const bool bStats = false;
+#endif
+
+#ifdef KTHREADPOOL_TRACE
+	const bool bTrace = true;
+#else
+	const bool bTrace = false;
+#endif
+
+	std::cout << "{\"bench\":\"meta\",\"cpus\":" << KThreadPool::GetAvailableCpuCount() << ",\"max_threads\":" << Settings.MaxThreads
+		<< ",\"reps\":" << Settings.Reps << ",\"ndebug\":" << (bOptimized ? "true" : "false")
+		<< ",\"stats\":" << (bStats ? "true" : "false") << ",\"trace\":" << (bTrace ? "true" : "false") << "}\n";
+
+	if (ShouldRun("empty_jobs")) Bench_EmptyJobs();
+	if (ShouldRun("latency")) Bench_Latency();
+	if (ShouldRun("iterate")) Bench_IterateScaling();
+	if (ShouldRun("weighted")) Bench_WeightedImbalance();
+	if (ShouldRun("contention")) Bench_Contention();
+
+	return 0;
+}
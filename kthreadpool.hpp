@@ -6,326 +6,4709 @@
 #include <vector>
 #include <mutex>
 #include <atomic>
+#include <condition_variable>
 #include <type_traits>
+#include <memory>
+#include <new>
+#include <optional>
+#include <deque>
+#include <algorithm>
+#include <span>
+#include <coroutine>
+#include <exception>
+#include <cstddef>
+#include <cstdint>
+#include <cassert>
+
+#if defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+#include <intrin.h>
+#endif
+
+#ifdef KTHREADPOOL_STATS
+#include <bit>
+#endif
+
+#ifdef KTHREADPOOL_TRACE
+#include <cstdio>
+#include <string>
+#endif
+
+#if defined(__linux__)
+#include <cstdlib>
+#include <fstream>
+#include <string>
+#include <sched.h>
+#include <pthread.h>
+#endif
 
 class KThreadPool
 {
+public:
+
+	// lane a job is queued in, higher priority jobs are always taken first
+	//    except that every StarvationInterval takes a thread picks the oldest job from the lowest non-empty lane
+	enum class EJobPriority : uint8_t
+	{
+		High,
+		Normal,
+		Background,
+
+		Count
+	};
+
+	// order that jobs within the same lane are taken in
+	enum class EQueueOrder : uint8_t
+	{
+		// most recently added runs first, best for cache locality and recursive work
+		Lifo,
+
+		// oldest runs first, bounds how long any job can wait
+		Fifo,
+	};
+
+	// where pool threads are allowed to run, placement is only applied on Linux
+	enum class EAffinity : uint8_t
+	{
+		// left to the OS scheduler
+		None,
+
+		// each thread pinned to one CPU, spread over physical cores and NUMA nodes before using hyperthread siblings
+		Core,
+
+		// each thread kept on the CPUs of one NUMA node, nodes are assigned round-robin
+		Node,
+	};
+
+	// what adding a job does when its lane's bounded queue is full
+	enum class EBackpressure : uint8_t
+	{
+		// wait until a thread takes a job from the lane
+		Block,
+
+		// busy wait for space, lowest latency when the pool is expected to catch up quickly
+		Spin,
+
+		// drop the job, AddFunctionToPool returns false and Submit returns an invalid future
+		Fail,
+
+		// run the job on the adding thread right away
+		RunInline,
+	};
+
+	struct PoolOptions
+	{
+		// number of threads in the pool, set to 0 to use DefaultThreadCount
+		//    or if that is also 0, one per CPU this process can use
+		int ThreadCount = 0;
+
+		// with ThreadCount 0, use one thread per physical core instead of one per hardware thread
+		bool bPhysicalCores = false;
+
+		EAffinity Affinity = EAffinity::None;
+
+		// time threads sleep between checks for new jobs to be posted
+		//    when 0 idle threads spin briefly and then park until a job is added, which is preferred in almost all cases
+		double RestTime = 0;
+
+		EQueueOrder Order = EQueueOrder::Lifo;
+
+		// when non-zero, each lane is a lock-free bounded queue of at least this many jobs instead of a locked deque
+		//    bounded lanes are always first in first out, Order still applies to each thread's own deque
+		size_t QueueCapacity = 0;
+
+		EBackpressure Backpressure = EBackpressure::Block;
+
+		// most threads SetThreadCount and elastic scaling can grow the pool to,
+		//    0 for one per CPU this process can use or the starting thread count if that is larger
+		// a worker is set up for every one of them up front, so a thread can be started again without
+		//    anyone looking for work through the workers having to lock against it, a worker that never runs costs a few KB
+		int MaxThreadCount = 0;
+
+		// adds a thread when jobs stay queued over two samples with no thread idle,
+		//    and retires one once some thread has been parked for ElasticIdleTimeout, within MinThreadCount and MaxThreadCount
+		// idle threads are only seen when they park, so this needs a RestTime of 0
+		bool bElastic = false;
+		int MinThreadCount = 1;
+
+		// seconds between samples of the queue, and seconds of idling before a thread is retired
+		double ElasticInterval = .01;
+		double ElasticIdleTimeout = 2.0;
+
+		// bytes reserved up front for each thread's scratch arena, 0 to allocate on first use
+		//    arenas grow past this on their own, the reservation only saves the first jobs from doing so
+		size_t ScratchSize = 0;
+	};
+
+	// size used to keep data written by different threads on separate cache lines
+	// gcc warns that its value depends on the tuning flags, which would change the pool's layout between builds
+#if defined(__cpp_lib_hardware_interference_size) && !defined(__GNUC__)
+	static constexpr size_t CacheLineSize = std::hardware_destructive_interference_size;
+#else
+	static constexpr size_t CacheLineSize = 64;
+#endif
+
+	// temporary memory for the job or chunk running on a thread, taken from GetScratchArena
+	// everything allocated is released when the job or Iterate chunk that allocated it returns,
+	//    so nothing allocated before a co_await or outside the current job can be relied on
+	// allocations past the end of the block get their own and the block grows to fit them
+	//    once the thread is done with its job, so a thread that runs the same jobs stops allocating
+	class ScratchArena
+	{
+	public:
+
+		// size bytes aligned to alignment, which must be a power of two
+		void* Allocate(size_t size, size_t alignment = alignof(std::max_align_t))
+		{
+			const uintptr_t base = (uintptr_t)Block.get();
+			const uintptr_t start = (base + Used + alignment - 1) & ~(uintptr_t)(alignment - 1);
+			if (Block && start + size <= base + Capacity)
+			{
+				Used = start + size - base;
+				return (void*)start;
+			}
+
+			Overflow.push_back(std::make_unique<std::byte[]>(size + alignment - 1));
+			OverflowBytes += size + alignment - 1;
+
+			const uintptr_t overflow = (uintptr_t)Overflow.back().get();
+			return (void*)((overflow + alignment - 1) & ~(uintptr_t)(alignment - 1));
+		}
+
+		// count default constructed Ts, nothing is destroyed when the arena rewinds
+		template <typename T>
+		T* Allocate(size_t count)
+		{
+			static_assert(std::is_trivially_destructible<T>::value, "Scratch memory is released without running destructors");
+
+			T* data = (T*)Allocate(count * sizeof(T), alignof(T));
+			for (size_t i = 0; i < count; i++)
+				new (data + i) T;
+
+			return data;
+		}
+
+		template <typename T>
+		std::span<T> AllocateSpan(size_t count) { return std::span<T>(Allocate<T>(count), count); }
+
+		// bytes the block can hold before allocations spill over
+		size_t GetCapacity() const { return Capacity; }
+
+		// bytes allocated from the block so far, not counting what spilled over
+		size_t GetUsed() const { return Used; }
+
+		void Reserve(size_t capacity)
+		{
+			if (capacity <= Capacity) return;
+
+			// only while nothing is allocated, the block moves
+			assert(Used == 0 && Overflow.empty());
+			Block = std::make_unique<std::byte[]>(capacity);
+			Capacity = capacity;
+		}
+
+	private:
+
+		friend class KThreadPool;
+
+		// what was allocated when a job or chunk started, restored when it returns
+		struct Mark
+		{
+			size_t Used;
+			size_t OverflowCount;
+		};
+
+		Mark GetMark() const { return { Used, Overflow.size() }; }
+
+		void Rewind(const Mark& mark)
+		{
+			Used = mark.Used;
+			if (Overflow.size() == mark.OverflowCount) return;
+
+			Overflow.resize(mark.OverflowCount);
+
+			// grow once nothing is left that points into the block
+			if (mark.Used == 0 && mark.OverflowCount == 0)
+			{
+				Reserve(Capacity + OverflowBytes);
+				OverflowBytes = 0;
+			}
+		}
+
+		std::unique_ptr<std::byte[]> Block;
+		size_t Capacity = 0;
+		size_t Used = 0;
+
+		// allocations that didn't fit, and their total size so far
+		std::vector<std::unique_ptr<std::byte[]>> Overflow;
+		size_t OverflowBytes = 0;
+	};
+
+#ifdef KTHREADPOOL_STATS
+	// histograms have one bucket per power of two nanoseconds, bucket i counts durations in [2^i, 2^(i+1)) ns
+	//    and the last one everything longer, about 2 seconds and up
+	static constexpr size_t HistogramBucketCount = 32;
+
+	struct WorkerStats
+	{
+		// jobs this thread ran, including ones it ran while helping inside a wait
+		uint64_t ExecutedJobs = 0;
+
+		// jobs this thread took from another thread's deque
+		uint64_t StolenJobs = 0;
+
+		// time spent spinning or parked with nothing to run
+		double IdleSeconds = 0;
+
+		// time spent running jobs, nested jobs run while helping are counted in the job that waited too
+		double BusySeconds = 0;
+
+		// largest number of jobs seen in this thread's own deque
+		size_t PeakLocalQueueDepth = 0;
+	};
+
+	// snapshot of a pool's counters, taken with relaxed loads so it is approximate while jobs run
+	struct PoolStats
+	{
+		std::vector<WorkerStats> Workers;
+
+		// time from a job being queued to a thread starting it
+		uint64_t QueueLatency[HistogramBucketCount] = {};
+
+		// time from a thread starting a job to it returning
+		uint64_t ExecutionTime[HistogramBucketCount] = {};
+
+		// largest number of jobs seen waiting in the shared lanes
+		size_t PeakQueueDepth = 0;
+
+		// upper bound in seconds of the bucket that fraction of the values in histogram fall at or below
+		static double Percentile(const uint64_t (&histogram)[HistogramBucketCount], double fraction)
+		{
+			uint64_t total = 0;
+			for (uint64_t count : histogram)
+				total += count;
+
+			uint64_t seen = 0;
+			for (size_t i = 0; i < HistogramBucketCount; i++)
+			{
+				seen += histogram[i];
+				if (total > 0 && seen >= fraction * total)
+					return (double)(uint64_t(2) << i) * 1e-9;
+			}
+
+			return 0;
+		}
+	};
+#endif
+
 private:
 
+	struct JobSlot;
+
 	struct ThreadJobBase
 	{
+		// arena slot this job was constructed in, null if it was allocated with new
+		JobSlot* Slot = nullptr;
+
+		EJobPriority Priority = EJobPriority::Normal;
+
+		// the job lives inside something the pool doesn't own, like a coroutine frame, which can be gone
+		//    as soon as Execute returns, so the pool neither releases nor destroys it
+		bool bEmbedded = false;
+
+		// added by the user, so ClearPendingJobs can drop it
+		// jobs the pool adds for itself, like Iterate runners, always run since something is waiting on them
+		bool bDiscardable = false;
+
+#ifdef KTHREADPOOL_STATS
+		// when the job was queued, in ClockNanoseconds
+		uint64_t QueuedTime = 0;
+#endif
+
 		virtual void Execute() = 0;
+		virtual ~ThreadJobBase() = default;
+
+		// called by the pool after Execute, returns true if the pool should destroy the job now
+		// jobs with other owners, like the state behind a Future, override this to drop the pool's reference
+		virtual bool Release() { return true; }
+
+		// called instead of Execute when ClearPendingJobs drops the job, the pool then releases it as usual
+		virtual void Abandon() {}
+
+		// called when Execute throws, returns true if the job keeps the exception for whoever waits on it
+		//    otherwise the pool holds on to it until the next WaitForFinish
+		virtual bool CaptureException(std::exception_ptr) { return false; }
+	};
+
+	// resumes a suspended coroutine, embedded in the awaiter that suspended it
+	struct ResumeJob : public ThreadJobBase
+	{
+		std::coroutine_handle<> Handle;
+
+		ResumeJob() { bEmbedded = true; }
+
+		virtual void Execute() override
+		{
+			Handle.resume();
+		}
+	};
+
+	// counts down the jobs that a blocking call posted, the last one to finish wakes the caller
+	struct JobLatch
+	{
+		std::atomic<uint32_t> Remaining;
+
+		JobLatch(uint32_t count) : Remaining(count) {}
+
+		void CountDown()
+		{
+			if (Remaining.fetch_sub(1, std::memory_order_acq_rel) == 1)
+				Remaining.notify_all();
+		}
+
+		bool IsDone() const { return Remaining.load(std::memory_order_acquire) == 0; }
+	};
+
+	// first exception thrown by a group of jobs and how many of them threw, only touched when one does
+	struct ErrorCollector
+	{
+		std::mutex Mutex;
+		std::exception_ptr First;
+		std::atomic<size_t> Count { 0 };
+
+		void Capture(std::exception_ptr error)
+		{
+			std::lock_guard<std::mutex> lock(Mutex);
+			if (!First) First = error;
+			Count.fetch_add(1, std::memory_order_relaxed);
+		}
+
+		bool HasErrors() const { return Count.load(std::memory_order_relaxed) > 0; }
+
+		// throws a JobError with everything captured so far and starts over
+		[[noreturn]] void Rethrow()
+		{
+			JobError error;
+			{
+				std::lock_guard<std::mutex> lock(Mutex);
+				error.First = std::move(First);
+				error.Count = Count.exchange(0, std::memory_order_relaxed);
+				First = nullptr;
+			}
+
+			throw error;
+		}
+	};
+
+	// size of the inline storage in a job slot, jobs that don't fit are allocated with new
+	static constexpr size_t JobSlotSize = 112;
+
+	// one cache line pair, holds a job object in place along with its free list link
+	struct alignas(64) JobSlot
+	{
+		// index of the next free slot while this one is in a free list
+		std::atomic<uint32_t> Next { 0 };
+		uint32_t Index = 0;
+
+		alignas(16) unsigned char Storage[JobSlotSize];
+	};
+
+	// free slots held by one pool thread, only touched by that thread
+	struct SlotCache
+	{
+		uint32_t Head = 0xffffffff;
+		uint32_t Tail = 0xffffffff;
+		uint32_t Count = 0;
+	};
+
+	// recycled storage for job objects so adding a job doesn't go through the allocator
+	// slots freed on a pool thread go into its own cache and are reused by jobs it adds,
+	//    everything else goes through a lock-free shared free list indexed by slot so it can be tagged against ABA
+	struct JobArena
+	{
+		static constexpr uint32_t NoSlot = 0xffffffff;
+		static constexpr uint32_t SlabSize = 1024;
+		static constexpr uint32_t MaxSlabs = 1024;
+
+		// a thread's cache is handed back to the shared list once it holds this many slots
+		static constexpr uint32_t CacheLimit = 1024;
+
+		// low 32 bits are the first free slot, high 32 bits are bumped on every change
+		std::atomic<uint64_t> FreeHead { NoSlot };
+
+		// slabs are never freed or moved until the arena is destroyed
+		std::atomic<JobSlot*> Slabs[MaxSlabs] = {};
+		uint32_t SlabCount = 0;
+		std::mutex SlabMutex;
+
+		~JobArena()
+		{
+			for (uint32_t i = 0; i < SlabCount; i++)
+				delete[] Slabs[i].load(std::memory_order_relaxed);
+		}
+
+		JobSlot* GetSlot(uint32_t index)
+		{
+			return &Slabs[index / SlabSize].load(std::memory_order_acquire)[index % SlabSize];
+		}
+
+		// returns null if the arena is out of slabs
+		JobSlot* Allocate(SlotCache* cache)
+		{
+			if (cache && cache->Head != NoSlot)
+			{
+				JobSlot* slot = GetSlot(cache->Head);
+				cache->Head = slot->Next.load(std::memory_order_relaxed);
+				if (--cache->Count == 0) cache->Tail = NoSlot;
+
+				return slot;
+			}
+
+			uint64_t head = FreeHead.load(std::memory_order_acquire);
+			while ((uint32_t)head != NoSlot)
+			{
+				// the slot may be popped and reused under us, its Next is garbage then but the tag makes the exchange fail
+				JobSlot* slot = GetSlot((uint32_t)head);
+				const uint64_t next = (((head >> 32) + 1) << 32) | slot->Next.load(std::memory_order_relaxed);
+
+				if (FreeHead.compare_exchange_weak(head, next, std::memory_order_acquire, std::memory_order_acquire))
+					return slot;
+			}
+
+			return Grow();
+		}
+
+		void Free(JobSlot* slot, SlotCache* cache)
+		{
+			if (cache)
+			{
+				slot->Next.store(cache->Head, std::memory_order_relaxed);
+				cache->Head = slot->Index;
+				if (cache->Count++ == 0) cache->Tail = slot->Index;
+
+				if (cache->Count >= CacheLimit)
+				{
+					// this thread frees more than it allocates, let other threads have them
+					PushShared(GetSlot(cache->Head), GetSlot(cache->Tail));
+					*cache = SlotCache();
+				}
+
+				return;
+			}
+
+			PushShared(slot, slot);
+		}
+
+		// push a chain of slots already linked from first to last
+		void PushShared(JobSlot* first, JobSlot* last)
+		{
+			uint64_t head = FreeHead.load(std::memory_order_relaxed);
+			uint64_t next;
+			do
+			{
+				last->Next.store((uint32_t)head, std::memory_order_relaxed);
+				next = (((head >> 32) + 1) << 32) | first->Index;
+			} 
+			while (!FreeHead.compare_exchange_weak(head, next, std::memory_order_release, std::memory_order_relaxed));
+		}
+
+		// allocate a new slab, return its first slot and share the rest
+		JobSlot* Grow()
+		{
+			std::lock_guard<std::mutex> lock(SlabMutex);
+			if (SlabCount == MaxSlabs) return nullptr;
+
+			JobSlot* slab = new JobSlot[SlabSize];
+			for (uint32_t i = 0; i < SlabSize; i++)
+			{
+				slab[i].Index = SlabCount * SlabSize + i;
+				slab[i].Next.store(slab[i].Index + 1, std::memory_order_relaxed);
+			}
+
+			Slabs[SlabCount].store(slab, std::memory_order_release);
+			SlabCount++;
+
+			PushShared(&slab[1], &slab[SlabSize - 1]);
+			return &slab[0];
+		}
 	};
 
 	struct IterSection
 	{
 		size_t Start, End;
+
+		// total weight of the elements in the section
+		double Weight;
+	};
+
+	// Vyukov's bounded multi-producer multi-consumer queue
+	// every cell carries a sequence number that tells producers and consumers whose turn it is,
+	//    so adding and taking are each one CAS on their own position with no lock
+	struct BoundedJobQueue
+	{
+		struct Cell
+		{
+			std::atomic<size_t> Sequence;
+			ThreadJobBase* Job;
+		};
+
+		std::unique_ptr<Cell[]> Cells;
+		size_t Mask = 0;
+
+		alignas(CacheLineSize) std::atomic<size_t> EnqueuePosition { 0 };
+		alignas(CacheLineSize) std::atomic<size_t> DequeuePosition { 0 };
+
+		// capacity is rounded up to a power of two
+		void Init(size_t capacity)
+		{
+			size_t size = 2;
+			while (size < capacity)
+				size *= 2;
+
+			Cells.reset(new Cell[size]);
+			Mask = size - 1;
+
+			for (size_t i = 0; i < size; i++)
+				Cells[i].Sequence.store(i, std::memory_order_relaxed);
+		}
+
+		// returns false if the queue is full
+		bool Push(ThreadJobBase* job)
+		{
+			Cell* cell;
+			size_t position = EnqueuePosition.load(std::memory_order_relaxed);
+			while (true)
+			{
+				cell = &Cells[position & Mask];
+				const size_t sequence = cell->Sequence.load(std::memory_order_acquire);
+				const intptr_t difference = (intptr_t)sequence - (intptr_t)position;
+
+				if (difference == 0)
+				{
+					if (EnqueuePosition.compare_exchange_weak(position, position + 1, std::memory_order_relaxed))
+						break;
+				}
+				else if (difference < 0)
+				{
+					// the cell still holds the job from a lap ago
+					return false;
+				}
+				else
+				{
+					position = EnqueuePosition.load(std::memory_order_relaxed);
+				}
+			}
+
+			cell->Job = job;
+			cell->Sequence.store(position + 1, std::memory_order_release);
+			return true;
+		}
+
+		// returns null if the queue is empty
+		ThreadJobBase* Pop()
+		{
+			Cell* cell;
+			size_t position = DequeuePosition.load(std::memory_order_relaxed);
+			while (true)
+			{
+				cell = &Cells[position & Mask];
+				const size_t sequence = cell->Sequence.load(std::memory_order_acquire);
+				const intptr_t difference = (intptr_t)sequence - (intptr_t)(position + 1);
+
+				if (difference == 0)
+				{
+					if (DequeuePosition.compare_exchange_weak(position, position + 1, std::memory_order_relaxed))
+						break;
+				}
+				else if (difference < 0)
+				{
+					return nullptr;
+				}
+				else
+				{
+					position = DequeuePosition.load(std::memory_order_relaxed);
+				}
+			}
+
+			ThreadJobBase* job = cell->Job;
+
+			// hand the cell to the producer one lap ahead
+			cell->Sequence.store(position + Mask + 1, std::memory_order_release);
+			return job;
+		}
+
+		size_t Size() const
+		{
+			const size_t enqueued = EnqueuePosition.load(std::memory_order_relaxed);
+			const size_t dequeued = DequeuePosition.load(std::memory_order_relaxed);
+			return enqueued > dequeued ? enqueued - dequeued : 0;
+		}
 	};
 
-	std::vector<std::thread> Threads;
+	// Chase-Lev work stealing deque
+	// the owning thread pushes and pops at the bottom, any other thread can steal from the top
+	struct JobDeque
+	{
+		struct Ring
+		{
+			int64_t Mask;
+			std::unique_ptr<std::atomic<ThreadJobBase*>[]> Slots;
+
+			Ring(int64_t capacity) 
+				: Mask(capacity - 1), Slots(new std::atomic<ThreadJobBase*>[capacity]) {}
+
+			ThreadJobBase* Get(int64_t i) { return Slots[i & Mask].load(std::memory_order_relaxed); }
+			void Put(int64_t i, ThreadJobBase* job) { Slots[i & Mask].store(job, std::memory_order_relaxed); }
+		};
+
+		// thieves CAS Top while the owner writes Bottom on every push and pop, so they get separate lines
+		alignas(CacheLineSize) std::atomic<int64_t> Top { 0 };
+		alignas(CacheLineSize) std::atomic<int64_t> Bottom { 0 };
+		std::atomic<Ring*> Buffer;
+
+		// every ring this deque has used, old ones are kept alive because a thief may still be reading from them
+		std::vector<std::unique_ptr<Ring>> Rings;
+
+		JobDeque()
+		{
+			Rings.push_back(std::make_unique<Ring>(256));
+			Buffer.store(Rings.back().get(), std::memory_order_relaxed);
+		}
+
+		// owner only
+		void Push(ThreadJobBase* job)
+		{
+			const int64_t b = Bottom.load(std::memory_order_relaxed);
+			const int64_t t = Top.load(std::memory_order_acquire);
+			Ring* ring = Buffer.load(std::memory_order_relaxed);
+
+			if (b - t > ring->Mask)
+			{
+				// full, move everything into a ring twice the size
+				Rings.push_back(std::make_unique<Ring>((ring->Mask + 1) * 2));
+				Ring* grown = Rings.back().get();
+				for (int64_t i = t; i < b; i++)
+					grown->Put(i, ring->Get(i));
+
+				Buffer.store(grown, std::memory_order_release);
+				ring = grown;
+			}
+
+			ring->Put(b, job);
+			Bottom.store(b + 1, std::memory_order_release);
+		}
+
+		// owner only, takes the most recently pushed job
+		ThreadJobBase* Pop()
+		{
+			const int64_t b = Bottom.load(std::memory_order_relaxed) - 1;
+			Ring* ring = Buffer.load(std::memory_order_relaxed);
+			Bottom.store(b, std::memory_order_relaxed);
+			std::atomic_thread_fence(std::memory_order_seq_cst);
+			int64_t t = Top.load(std::memory_order_relaxed);
+
+			ThreadJobBase* job = nullptr;
+			if (t <= b)
+			{
+				job = ring->Get(b);
+				if (t == b)
+				{
+					// last job, race any thieves for it
+					if (!Top.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst, std::memory_order_relaxed))
+						job = nullptr;
+
+					Bottom.store(b + 1, std::memory_order_relaxed);
+				}
+			}
+			else
+			{
+				Bottom.store(b + 1, std::memory_order_relaxed);
+			}
+
+			return job;
+		}
+
+		// any thread, takes the oldest job
+		ThreadJobBase* Steal()
+		{
+			int64_t t = Top.load(std::memory_order_acquire);
+			std::atomic_thread_fence(std::memory_order_seq_cst);
+			const int64_t b = Bottom.load(std::memory_order_acquire);
+
+			if (t < b)
+			{
+				ThreadJobBase* job = Buffer.load(std::memory_order_acquire)->Get(t);
+				if (Top.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst, std::memory_order_relaxed))
+					return job;
+			}
+
+			return nullptr;
+		}
+
+		size_t Size() const
+		{
+			const int64_t size = Bottom.load(std::memory_order_relaxed) - Top.load(std::memory_order_relaxed);
+			return size > 0 ? (size_t)size : 0;
+		}
+	};
+
+#ifdef KTHREADPOOL_TRACE
+	enum class ETraceEvent : uint8_t
+	{
+		Job,
+		Chunk,
+		Section,
+	};
+
+	struct TraceEvent
+	{
+		// label set with SetTraceLabel, null for the default name of the event type
+		const char* Label = nullptr;
+
+		// ClockNanoseconds when the event started and ended
+		uint64_t Start = 0;
+		uint64_t End = 0;
+
+		// element range of a chunk or section
+		size_t First = 0;
+		size_t Last = 0;
+
+		// weight of a section
+		double Weight = 0;
+
+		ETraceEvent Type = ETraceEvent::Job;
+	};
+
+	// events recorded by one thread, the oldest are overwritten once it is full
+	// only the owning thread writes, DumpTrace skips anything that might have been overwritten while it read
+	struct TraceBuffer
+	{
+		std::unique_ptr<TraceEvent[]> Events { new TraceEvent[TraceCapacity] };
+		size_t Capacity = TraceCapacity;
+
+		// number of events ever recorded
+		std::atomic<uint64_t> Count { 0 };
+
+		void Record(const TraceEvent& event)
+		{
+			const uint64_t count = Count.load(std::memory_order_relaxed);
+			Events[count % Capacity] = event;
+			Count.store(count + 1, std::memory_order_release);
+		}
+	};
+#endif
+
+#ifdef KTHREADPOOL_STATS
+	// counts kept by one worker, written by that thread and read by GetStats while it runs
+	// additions are atomic so ResetStats from another thread never loses a zero
+	struct WorkerCounters
+	{
+		std::atomic<uint64_t> ExecutedJobs { 0 };
+		std::atomic<uint64_t> StolenJobs { 0 };
+		std::atomic<uint64_t> IdleNanoseconds { 0 };
+		std::atomic<uint64_t> BusyNanoseconds { 0 };
+		std::atomic<size_t> PeakLocalQueueDepth { 0 };
+		std::atomic<uint64_t> QueueLatency[HistogramBucketCount] = {};
+		std::atomic<uint64_t> ExecutionTime[HistogramBucketCount] = {};
+	};
+#endif
+
+	enum class EWorkerState : uint8_t
+	{
+		// no thread, or its thread has returned and only needs to be joined
+		Stopped,
+
+		Running,
+
+		// the thread returns the next time it runs out of jobs, unless the pool grows again first
+		Retiring,
+	};
+
+	// jobs counted as added and as finished by one thread, both only ever grow
+	// a job can be added on one thread and finished on another, so only the sum over every tally means anything
+	struct JobTally
+	{
+		std::atomic<size_t> Added { 0 };
+		std::atomic<size_t> Finished { 0 };
+	};
+
+	// state owned by each thread in the pool
+	// aligned so one worker's counters never share a cache line with another's
+	struct alignas(CacheLineSize) Worker
+	{
+		KThreadPool* Pool = nullptr;
+		size_t Index = 0;
+
+		std::atomic<EWorkerState> State { EWorkerState::Stopped };
+
+		// jobs added from inside this worker's jobs, stolen by other threads when they run dry
+		JobDeque LocalJobs;
+
+		// where this worker starts looking when it needs to steal, rotated so thieves spread across victims
+		size_t StealCursor = 0;
+
+		// job slots freed by this thread
+		SlotCache FreeSlots;
+
+		// number of times this worker has looked for a job, drives starvation protection
+		uint32_t TakeCount = 0;
+
+		// number of jobs running on this thread's stack, more than one when a job waits and helps run others
+		// only written by this thread, read by GetActiveJobCount
+		std::atomic<uint32_t> JobDepth { 0 };
+
+		// jobs on this thread's stack that are already counted in HelpingWaiterCount
+		uint32_t WaitingDepth = 0;
+
+		// jobs this thread added and finished, only written by this thread and summed by waiters
+		//    on its own line so the sums don't pull the rest of the worker away from its thread
+		alignas(CacheLineSize) JobTally Jobs;
+
+		// NUMA node this thread is placed on, always 0 when the pool doesn't place its threads
+		size_t Node = 0;
+
+		// CPUs this thread is restricted to, empty to leave it to the OS
+		std::vector<int> Cpus;
+
+		ScratchArena Scratch;
+
+#ifdef KTHREADPOOL_STATS
+		WorkerCounters Stats;
+#endif
+
+#ifdef KTHREADPOOL_TRACE
+		TraceBuffer Trace;
+#endif
+	};
+
+	// one logical CPU the process is allowed to run on
+	struct CpuInfo
+	{
+		int Cpu = 0;
+
+		// physical core, shared by hyperthread siblings
+		int Core = 0;
+
+		// NUMA node, numbered from 0 over the nodes that have a CPU we can use
+		size_t Node = 0;
+	};
+
+	// worker running on the current thread, null for threads that don't belong to a pool
+	inline static thread_local Worker* CurrentWorker = nullptr;
+
+	// scratch arena for threads outside any pool, for their share of an Iterate and jobs they help run
+	static ScratchArena& GetExternalScratch()
+	{
+		static thread_local ScratchArena scratch;
+		return scratch;
+	}
+
+#ifdef KTHREADPOOL_TRACE
+	// label for the job running on this thread, set with SetTraceLabel
+	inline static thread_local const char* CurrentTraceLabel = nullptr;
+
+	// events from threads outside the pool, like the caller's share of an Iterate
+	TraceBuffer ExternalTrace;
+	std::mutex ExternalTraceMutex;
+#endif
+
+	// members are grouped by how often and by whom they are written,
+	//    each group that is written while jobs run starts on its own cache line so it doesn't bounce the others
+
+	// set up by the constructor and only read afterward, except Threads which SetThreadCount changes under ResizeMutex
+	// one slot per thread the pool can grow to, a slot's thread is only running while its worker isn't stopped
+	std::vector<std::thread> Threads;
+
+	// one per thread slot, created before any thread starts and never resized
+	std::vector<std::unique_ptr<Worker>> Workers;
+
+	// number of slots that have ever had a thread, threads only look for jobs to steal in these
+	std::atomic<size_t> StartedWorkerCount { 0 };
+
+	double RestTime = 0;
+
+	// number of NUMA nodes the threads are placed on, 1 unless the pool places its threads
+	size_t NodeCount = 1;
+
+	EQueueOrder Order = EQueueOrder::Lifo;
+
+	// whether or not the pool is pending destroy, read by every idle thread and written once
+	std::atomic<bool> bDestroyingPool { false };
+
+	// jobs added and finished by threads outside the pool, each pool thread keeps its own tally in its worker
+	// the number of unfinished jobs is only known by summing every tally, see GetUnfinishedJobCount
+	alignas(CacheLineSize) JobTally ExternalJobs;
+
+	// number of threads blocked in WaitForFinish, tallies are only summed to find the last finish while this is non-zero
+	std::atomic<int> FinishWaiterCount { 0 };
+
+	// number of jobs on the stack of a pool thread that is inside WaitForFinish
+	// those jobs can't finish until the wait returns, so the wait is over once they are the only unfinished jobs left
+	std::atomic<size_t> HelpingWaiterCount { 0 };
+
+	// bumped on every add and finish while HelpingWaiterCount is non-zero, helping waiters park on it
+	std::atomic<uint32_t> HelpEpoch { 0 };
+
+	// signaled when the last unfinished job finishes
+	alignas(CacheLineSize) std::mutex FinishMutex;
+	std::condition_variable FinishCondition;
+
+	// exceptions from jobs nobody else waits on, rethrown by WaitForFinish
+	ErrorCollector JobErrors;
+
+	// functions added from outside the pool, or with a priority other than Normal, waiting to be picked up by a thread
+	// one lane per EJobPriority
+	alignas(CacheLineSize) std::deque<ThreadJobBase*> PendingJobs[(size_t)EJobPriority::Count];
+
+	// mutex to allow multiple threads to read from PendingJobs
+	std::mutex QueueMutex;
+
+	// size of each PendingJobs lane, lets threads skip QueueMutex when there is nothing to take
+	std::atomic<size_t> PendingJobsSize[(size_t)EJobPriority::Count] = {};
+
+	// one lock-free queue per lane when the pool was created with a QueueCapacity, null otherwise
+	// PendingJobs then only holds jobs the pool itself had to add while a lane was full, like continuations
+	std::unique_ptr<BoundedJobQueue[]> BoundedLanes;
+
+	EBackpressure Backpressure = EBackpressure::Block;
+
+	// number of threads that are not retiring, written by SetThreadCount
+	alignas(CacheLineSize) std::atomic<int> ThreadCount { 0 };
+	std::mutex ResizeMutex;
+
+	// samples the queue and resizes the pool when it was created with bElastic
+	std::thread ElasticThread;
+	std::mutex ElasticMutex;
+	std::condition_variable ElasticCondition;
+
+	// bumped when a job is taken from a bounded lane while producers are blocked on it being full
+	// first in its line so it doesn't share a wait queue with WakeEpoch, see there
+	alignas(CacheLineSize) std::atomic<uint32_t> SpaceEpoch { 0 };
+	std::atomic<int> BlockedProducerCount { 0 };
+
+	// storage for jobs added with AddFunctionToPool
+	alignas(CacheLineSize) JobArena Arena;
+
+#ifdef KTHREADPOOL_STATS
+	// largest size seen of any PendingJobs lane, only written under QueueMutex
+	std::atomic<size_t> PeakQueueDepth { 0 };
+#endif
+
+	// number of threads currently parked on WakeEpoch, posting only issues a wakeup when this is non-zero
+	alignas(CacheLineSize) std::atomic<int> ParkedCount { 0 };
+
+	// bumped every time a job is posted, idle threads spin on this and park on it with std::atomic::wait
+	// kept off the start of its line on purpose: libstdc++ picks one of 16 shared waiter entries for an atomic
+	//    from (address >> 2) % 16, so atomics at the same offset in different cache lines share an entry,
+	//    and a notify on one then makes a futex call whenever anything is parked on the other
+	// this depends on that library's internals and only holds while no other atomic that is waited on
+	//    sits at offset 4 of its line, SpaceEpoch and HelpEpoch are placed with that in mind
+	std::atomic<uint32_t> WakeEpoch { 0 };
+
+public:
+
+	// default number of threads to be used in a pool, leave at 0 to use one per CPU this process can use
+	// setting this to ( GetAvailableCpuCount() - 1 ) can be useful to prevent the user's computer from locking up during long tasks
+	inline static int DefaultThreadCount = 0;
+
+#ifdef KTHREADPOOL_TRACE
+	// number of events each thread keeps for DumpTrace, read when a pool is created
+	inline static size_t TraceCapacity = 1 << 15;
+#endif
+
+	// a thread takes the oldest job from the lowest non-empty lane once every this many takes
+	inline static uint32_t StarvationInterval = 32;
+
+	// number of times an idle thread checks for new work before parking
+	// spinning keeps wakeup latency low for bursty submitters, parking keeps an idle pool from using any CPU
+	inline static int IdleSpinCount = 4096;
+
+	// how Iterate splits elements between threads
+	enum class EPartition
+	{
+		// each thread gets one contiguous range computed up front, lowest overhead when every element costs the same
+		Static,
+
+		// threads claim chunks that start large and shrink as the remaining elements run out
+		Guided,
+
+		// threads claim GrainSize elements at a time until there are none left
+		Dynamic,
+	};
+
+	// thrown by WaitForFinish, RunGraph and the Iterate family when jobs threw
+	// holds the first exception and how many were thrown, the pool keeps running either way
+	struct JobError : public std::exception
+	{
+		std::exception_ptr First;
+		size_t Count = 0;
+
+		virtual const char* what() const noexcept override { return "KThreadPool job threw an exception"; }
+
+		[[noreturn]] void RethrowFirst() const { std::rethrow_exception(First); }
+	};
+
+	// thrown by Wait, Get, Then and co_await on a future with no job behind it,
+	//    because Submit dropped the job under EBackpressure::Fail or the result was already taken
+	struct InvalidFuture : public std::exception
+	{
+		virtual const char* what() const noexcept override { return "KThreadPool future has no job"; }
+	};
+
+	// thrown by Get and co_await on a future with a result whose job was dropped by ClearPendingJobs
+	struct JobCancelled : public std::exception
+	{
+		virtual const char* what() const noexcept override { return "KThreadPool job was cancelled before it ran"; }
+	};
+
+	// set from any thread to stop the loops it was passed to
+	// loops check it before each chunk they claim, so a chunk that has started still runs to its end
+	class CancellationToken
+	{
+		std::atomic<bool> bCancelled { false };
+
+	public:
+
+		void Cancel() { bCancelled.store(true, std::memory_order_relaxed); }
+		void Reset() { bCancelled.store(false, std::memory_order_relaxed); }
+
+		bool IsCancelled() const { return bCancelled.load(std::memory_order_relaxed); }
+	};
+
+	struct IterOptions
+	{
+		EPartition Partition = EPartition::Dynamic;
+
+		// smallest number of elements a thread claims at a time, 0 picks one from the element and thread count
+		size_t GrainSize = 0;
+
+		// every chunk starts on a multiple of this many elements, only the last one can be shorter
+		//    for functors taking a span that want whole cache lines or SIMD registers, 0 or 1 doesn't align
+		size_t ChunkAlignment = 0;
+
+		// optional, once cancelled no more chunks are started and the loop returns, leaving the rest unvisited
+		const CancellationToken* Cancel = nullptr;
+	};
+
+	// measured cost of a weighted iteration, kept between calls over the same data to correct the weight function
+	// each element gets a correction factor that is nudged toward the time its section actually took per unit of weight
+	class WeightProfile
+	{
+		friend class KThreadPool;
+
+		std::vector<double> Factors;
+
+		// applies the measured time of each section to the factors of the elements in it
+		void Update(const std::vector<IterSection>& sections, const std::vector<double>& seconds)
+		{
+			double totalWeight = 0;
+			double totalSeconds = 0;
+			for (size_t i = 0; i < sections.size(); i++)
+			{
+				totalWeight += sections[i].Weight;
+				totalSeconds += seconds[i];
+			}
+
+			if (totalWeight <= 0 || totalSeconds <= 0) return;
+
+			const double averageCost = totalSeconds / totalWeight;
+			for (size_t i = 0; i < sections.size(); i++)
+			{
+				if (sections[i].Weight <= 0) continue;
+
+				// only move halfway each call and clamp the step so one noisy measurement can't swing the model
+				double ratio = (seconds[i] / sections[i].Weight) / averageCost;
+				ratio = ratio < .25 ? .25 : (ratio > 4 ? 4 : ratio);
+				const double step = .5 + .5 * ratio;
+
+				for (size_t e = sections[i].Start; e < sections[i].End; e++)
+					Factors[e] *= step;
+			}
+		}
+
+	public:
+
+		// forget everything measured so far
+		void Reset() { Factors.clear(); }
+	};
+
+	struct WeightedOptions
+	{
+		// number of sections per thread, more sections even out wrong weights at the cost of more claims
+		// sections are claimed heaviest first by whichever thread is free
+		size_t SectionsPerThread = 8;
+
+		// optional, times each section and corrects the weights on later calls over data with the same element count
+		WeightProfile* Profile = nullptr;
+
+		// every section starts on a multiple of this many elements, same as IterOptions::ChunkAlignment
+		size_t ChunkAlignment = 0;
+
+		// optional, same as IterOptions::Cancel but checked before each section
+		const CancellationToken* Cancel = nullptr;
+	};
+
+private:
+
+	template <typename Functor, typename... TArgs>
+	struct ThreadJob : public ThreadJobBase
+	{
+		Functor Function;
+		std::tuple<TArgs...> Args;
+
+		// the functor and arguments are constructed in place, so moved arguments are only ever moved
+		template <typename F, typename... A>
+		ThreadJob(F&& func, A&&... args) 
+			: Function(std::forward<F>(func)), Args(std::forward<A>(args)...) {}
+
+		virtual void Execute() override
+		{
+			InvokeJob(Function, Args);
+		}
+	};
+
+	// a job only runs once, so its arguments are moved into the call
+	// functions that take non-const references get the stored copies as lvalues instead
+	template <typename Functor, typename... TArgs>
+	static decltype(auto) InvokeJob(Functor& func, std::tuple<TArgs...>& args)
+	{
+		if constexpr (std::is_invocable<Functor&, TArgs&&...>::value)
+			return std::apply(func, std::move(args));
+		else
+			return std::apply(func, args);
+	}
+
+	// make a job for one item of a batch, with the item as the last argument
+	// moved out of the range when the range itself was passed as an rvalue
+	template <typename Job, typename Range, typename Item, typename... TArgs>
+	Job* MakeBatchJob(Item& item, TArgs&&... args)
+	{
+		if constexpr (std::is_lvalue_reference<Range>::value)
+			return MakeJob<Job>(std::forward<TArgs>(args)..., item);
+		else
+			return MakeJob<Job>(std::forward<TArgs>(args)..., std::move(item));
+	}
+
+	// construct a job in an arena slot if it fits, otherwise on the heap
+	template <typename Job, typename... TArgs>
+	Job* MakeJob(TArgs&&... args)
+	{
+		if constexpr (sizeof(Job) <= JobSlotSize && alignof(Job) <= 16)
+		{
+			Worker* worker = GetLocalWorker();
+			if (JobSlot* slot = Arena.Allocate(worker ? &worker->FreeSlots : nullptr))
+			{
+				Job* job = new (slot->Storage) Job(std::forward<TArgs>(args)...);
+				job->Slot = slot;
+				return job;
+			}
+		}
+
+		return new Job(std::forward<TArgs>(args)...);
+	}
+
+	void DestroyJob(ThreadJobBase* job)
+	{
+		if (JobSlot* slot = job->Slot)
+		{
+			job->~ThreadJobBase();
+
+			Worker* worker = GetLocalWorker();
+			Arena.Free(slot, worker ? &worker->FreeSlots : nullptr);
+		}
+		else
+		{
+			delete job;
+		}
+	}
+
+	// result and completion state shared by a job added with Submit and its Future
+	// lives in the job's own arena slot when it fits, so getting a result back costs no extra allocation
+	template <typename R>
+	struct FutureJobBase : public ThreadJobBase
+	{
+		KThreadPool* Pool;
+
+		// one for the pool until the job has run, one for the Future
+		std::atomic<int> RefCount { 2 };
+
+		// counts down once the result is stored
+		JobLatch Done { 1 };
+
+		// job to post once the result is ready, set to this state itself once it's too late to attach one
+		std::atomic<ThreadJobBase*> Continuation { nullptr };
+
+		std::optional<std::conditional_t<std::is_void<R>::value, char, R>> Result;
+
+		// the job was dropped before it ran, written before Done counts down
+		bool bCancelled = false;
+
+		// thrown by the job, rethrown by Get
+		std::exception_ptr Error;
+
+		FutureJobBase(KThreadPool* pool) : Pool(pool) {}
+
+		virtual bool CaptureException(std::exception_ptr error) override
+		{
+			Error = error;
+			SetReady();
+			return true;
+		}
+
+		// ready without a result, a continuation from Then is dropped along with it
+		virtual void Abandon() override
+		{
+			bCancelled = true;
+			Done.CountDown();
+
+			ThreadJobBase* next = Continuation.exchange(this, std::memory_order_acq_rel);
+			if (!next) return;
+
+			// an awaiting coroutine still has to be resumed, it finds the future cancelled
+			if (next->bDiscardable)
+				Pool->DiscardJob(next);
+			else
+				Pool->PostJob(next);
+		}
+
+		virtual bool Release() override
+		{
+			return RefCount.fetch_sub(1, std::memory_order_acq_rel) == 1;
+		}
+
+		// the pool still holds its reference here, so the state outlives anyone woken by the latch
+		void SetReady()
+		{
+			Done.CountDown();
+
+			ThreadJobBase* next = Continuation.exchange(this, std::memory_order_acq_rel);
+			if (next) Pool->PostJob(next);
+		}
+
+		// post job once this state is ready, or right away if it already is
+		void SetContinuation(ThreadJobBase* job)
+		{
+			if (!TrySetContinuation(job))
+				Pool->PostJob(job);
+		}
+
+		// same as above but returns false instead of posting job if the state is already ready
+		bool TrySetContinuation(ThreadJobBase* job)
+		{
+			ThreadJobBase* expected = nullptr;
+			return Continuation.compare_exchange_strong(expected, job, std::memory_order_acq_rel);
+		}
+	};
+
+	template <typename R, typename Functor, typename... TArgs>
+	struct SubmitJob : public FutureJobBase<R>
+	{
+		Functor Function;
+		std::tuple<TArgs...> Args;
+
+		template <typename F, typename... A>
+		SubmitJob(KThreadPool* pool, F&& func, A&&... args) 
+			: FutureJobBase<R>(pool), Function(std::forward<F>(func)), Args(std::forward<A>(args)...) {}
+
+		virtual void Execute() override
+		{
+			if constexpr (std::is_void<R>::value)
+				InvokeJob(Function, Args);
+			else
+				this->Result.emplace(InvokeJob(Function, Args));
+
+			this->SetReady();
+		}
+	};
+
+	// result type of a job storing Functor and TArgs, references are stored as copies
+	template <typename Functor, typename... TArgs>
+	using JobResult = typename std::decay<decltype(InvokeJob(std::declval<Functor&>(), std::declval<std::tuple<TArgs...>&>()))>::type;
+
+public:
+
+	// handle to the result of a job added with Submit
+	// a Future must not outlive the pool it came from
+	template <typename R>
+	class Future
+	{
+		friend class KThreadPool;
+
+		FutureJobBase<R>* State = nullptr;
+
+		explicit Future(FutureJobBase<R>* state) : State(state) {}
+
+	public:
+
+		Future() = default;
+		Future(const Future&) = delete;
+		Future& operator=(const Future&) = delete;
+
+		Future(Future&& other) noexcept : State(other.State) { other.State = nullptr; }
+
+		Future& operator=(Future&& other) noexcept
+		{
+			if (this != &other)
+			{
+				Reset();
+				State = other.State;
+				other.State = nullptr;
+			}
+
+			return *this;
+		}
+
+		~Future() { Reset(); }
+
+		// false once the result has been taken by Get or Then, and for a job Submit dropped
+		bool IsValid() const { return State != nullptr; }
+
+		// always false for an invalid future, there is nothing to wait for
+		bool IsReady() const { return State && State->Done.IsDone(); }
+
+		// true once ready if the job was dropped by ClearPendingJobs instead of running, there is no result to Get
+		bool IsCancelled() const { return IsReady() && State->bCancelled; }
+
+		// blocks until the job has run, a pool thread calling this keeps running other jobs while it waits
+		// throws InvalidFuture if there is no job
+		void Wait() 
+		{ 
+			if (!State) throw InvalidFuture();
+			State->Pool->WaitForLatch(State->Done); 
+		}
+
+		// waits for the job and takes its result, the future is no longer valid afterward
+		// a cancelled future has no result, Get throws JobCancelled unless R is void
+		// if the job threw, Get rethrows its exception, a continuation from Then passes it on to its own future
+		R Get()
+		{
+			Wait();
+
+			if (State->Error)
+			{
+				std::exception_ptr error = State->Error;
+				Reset();
+				std::rethrow_exception(error);
+			}
+
+			if constexpr (std::is_void<R>::value)
+			{
+				Reset();
+			}
+			else
+			{
+				if (State->bCancelled)
+				{
+					Reset();
+					throw JobCancelled();
+				}
+
+				R result = std::move(*State->Result);
+				Reset();
+				return result;
+			}
+		}
+
+		// run func with this future's result on the pool once it's ready, the future is no longer valid afterward
+		// returns a future for func's result, which is cancelled without running func if this one is cancelled
+		template <typename Functor>
+		auto Then(Functor func)
+		{
+			// our reference to the parent state, dropped along with the continuation whether it runs or not
+			struct ParentRef
+			{
+				FutureJobBase<R>* Parent;
+
+				explicit ParentRef(FutureJobBase<R>* parent) : Parent(parent) {}
+				ParentRef(ParentRef&& other) noexcept : Parent(other.Parent) { other.Parent = nullptr; }
+				~ParentRef()
+				{
+					if (Parent && Parent->Release()) 
+						Parent->Pool->DestroyJob(Parent);
+				}
+			};
+
+			if (!State) throw InvalidFuture();
+
+			FutureJobBase<R>* parent = State;
+			State = nullptr;
+
+			auto next = [ref = ParentRef(parent), func = std::move(func)]() mutable -> decltype(auto)
+			{
+				FutureJobBase<R>* parent = ref.Parent;
+
+				// the parent's exception fails this job too, so it reaches the end of the chain
+				if (parent->Error) 
+					std::rethrow_exception(parent->Error);
+
+				if constexpr (std::is_void<R>::value)
+					return func();
+				else
+					return func(std::move(*parent->Result));
+			};
+
+			typedef JobResult<decltype(next)> U;
+			KThreadPool* pool = parent->Pool;
+			auto* job = pool->template MakeJob<SubmitJob<U, decltype(next)>>(pool, std::move(next));
+			job->Priority = parent->Priority;
+			job->bDiscardable = true;
+
+			// counted as unfinished right away so WaitForFinish covers the whole chain
+			// a parent that was already cancelled cancels the continuation the same way Abandon would have
+			pool->CountAddedJobs(1);
+			if (!parent->TrySetContinuation(job))
+			{
+				if (parent->bCancelled)
+					pool->DiscardJob(job);
+				else
+					pool->PostJob(job);
+			}
+
+			return Future<U>(job);
+		}
+
+		// co_await on a future suspends the coroutine until the job has run and resumes it on the pool with the result
+		// the future is no longer valid afterward, same as after Get
+		auto operator co_await() noexcept
+		{
+			struct Awaiter
+			{
+				Future& Source;
+				ResumeJob Job;
+
+				explicit Awaiter(Future& source) : Source(source) {}
+
+				// an invalid future doesn't suspend, await_resume throws right away
+				bool await_ready() const { return !Source.IsValid() || Source.IsReady(); }
+
+				bool await_suspend(std::coroutine_handle<> handle)
+				{
+					FutureJobBase<R>* state = Source.State;
+					KThreadPool* pool = state->Pool;
+
+					Job.Handle = handle;
+					Job.Priority = state->Priority;
+
+					// counted as unfinished like a continuation from Then
+					pool->CountAddedJobs(1);
+					if (state->TrySetContinuation(&Job))
+						return true;
+
+					// the job finished in the meantime, carry on without suspending
+					pool->FinishJobs(1);
+					return false;
+				}
+
+				R await_resume() { return Source.Get(); }
+			};
+
+			return Awaiter { *this };
+		}
+
+	private:
+
+		void Reset()
+		{
+			if (State && State->Release())
+				State->Pool->DestroyJob(State);
+
+			State = nullptr;
+		}
+	};
+
+	// set of tasks with dependencies between them, run on a pool with RunGraph
+	// a task is posted as soon as the last task it depends on finishes, so stages only wait for what they actually use
+	// a graph can be run any number of times but only by one RunGraph call at a time
+	class TaskGraph
+	{
+		friend class KThreadPool;
+
+		struct TaskFunctionBase
+		{
+			virtual void Invoke() = 0;
+			virtual ~TaskFunctionBase() = default;
+		};
+
+		// arguments are passed as lvalues since the task runs again every time the graph does
+		template <typename Functor, typename... TArgs>
+		struct TaskFunction : public TaskFunctionBase
+		{
+			Functor Function;
+			std::tuple<TArgs...> Args;
+
+			template <typename F, typename... A>
+			TaskFunction(F&& func, A&&... args) 
+				: Function(std::forward<F>(func)), Args(std::forward<A>(args)...) {}
+
+			virtual void Invoke() override
+			{
+				std::apply(Function, Args);
+			}
+		};
+
+		struct Task
+		{
+			std::unique_ptr<TaskFunctionBase> Function;
+
+			// tasks that depend on this one
+			std::vector<size_t> Successors;
+
+			// number of tasks this one depends on
+			uint32_t DependencyCount = 0;
+
+			// set when a task this one depends on threw or was skipped, the task is then skipped too
+			std::atomic<bool> bSkip { false };
+
+			// dependencies that haven't finished yet in the current run
+			std::atomic<uint32_t> Remaining { 0 };
+
+			EJobPriority Priority = EJobPriority::Normal;
+		};
+
+		// deque so tasks never move, they hold an atomic
+		std::deque<Task> Tasks;
+
+	public:
+
+		typedef size_t TaskId;
+
+		// add a task that runs func with args, returns an id used to add dependencies
+		template <typename Functor, typename... TArgs>
+		TaskId AddTask(Functor&& func, TArgs&&... args)
+		{
+			return AddTask(EJobPriority::Normal, std::forward<Functor>(func), std::forward<TArgs>(args)...);
+		}
+
+		// same as above but the task is queued in the lane for priority
+		template <typename Functor, typename... TArgs>
+		TaskId AddTask(EJobPriority priority, Functor&& func, TArgs&&... args)
+		{
+			typedef TaskFunction<typename std::decay<Functor>::type, typename std::decay<TArgs>::type...> Function;
+
+			Task& task = Tasks.emplace_back();
+			task.Function = std::make_unique<Function>(std::forward<Functor>(func), std::forward<TArgs>(args)...);
+			task.Priority = priority;
+
+			return Tasks.size() - 1;
+		}
+
+		// after only starts once before has finished
+		void AddDependency(TaskId before, TaskId after)
+		{
+			assert(before < Tasks.size() && after < Tasks.size() && before != after);
+
+			Tasks[before].Successors.push_back(after);
+			Tasks[after].DependencyCount++;
+		}
+
+		size_t GetTaskCount() const { return Tasks.size(); }
+
+		void Clear() { Tasks.clear(); }
+
+		// false if the dependencies contain a cycle, which would make RunGraph wait forever
+		bool IsAcyclic() const
+		{
+			std::vector<uint32_t> remaining(Tasks.size());
+			std::vector<size_t> ready;
+
+			for (size_t i = 0; i < Tasks.size(); i++)
+			{
+				remaining[i] = Tasks[i].DependencyCount;
+				if (remaining[i] == 0) ready.push_back(i);
+			}
+
+			size_t visited = 0;
+			while (!ready.empty())
+			{
+				const size_t index = ready.back();
+				ready.pop_back();
+				visited++;
+
+				for (size_t successor : Tasks[index].Successors)
+				{
+					if (--remaining[successor] == 0)
+						ready.push_back(successor);
+				}
+			}
+
+			return visited == Tasks.size();
+		}
+	};
+
+	// co_await pool.Schedule() suspends the coroutine and resumes it on one of the pool's threads
+	// the job that resumes it lives in the awaiter, inside the coroutine frame, so scheduling allocates nothing
+	class ScheduleAwaiter
+	{
+		KThreadPool* Pool;
+		ResumeJob Job;
+
+	public:
+
+		ScheduleAwaiter(KThreadPool* pool, EJobPriority priority) : Pool(pool)
+		{
+			Job.Priority = priority;
+		}
+
+		bool await_ready() const noexcept { return false; }
+
+		// the coroutine can resume on another thread before this returns, nothing here is touched after the job is added
+		void await_suspend(std::coroutine_handle<> handle)
+		{
+			Job.Handle = handle;
+			Pool->AddJobToPool(&Job);
+		}
+
+		void await_resume() const noexcept {}
+	};
+
+	// coroutine returning R, it starts when it is first awaited or when Get is called on it
+	// it runs on whichever thread starts or resumes it, co_await pool.Schedule() moves it onto a pool
+	template <typename R = void>
+	class Task
+	{
+	public:
+
+		struct promise_type;
+		typedef std::coroutine_handle<promise_type> Handle;
+
+	private:
+
+		// return_value and return_void can't both be declared, so the result half of the promise depends on R
+		template <typename U, typename Dummy = void>
+		struct PromiseResult
+		{
+			std::optional<U> Result;
+
+			template <typename V>
+			void return_value(V&& value) { Result.emplace(std::forward<V>(value)); }
+
+			U Take() { return std::move(*Result); }
+		};
+
+		template <typename Dummy>
+		struct PromiseResult<void, Dummy>
+		{
+			void return_void() {}
+			void Take() {}
+		};
+
+		// hands the thread straight to whoever awaited the task, or wakes Get
+		struct FinalAwaiter
+		{
+			bool await_ready() const noexcept { return false; }
+
+			std::coroutine_handle<> await_suspend(Handle handle) noexcept
+			{
+				promise_type& promise = handle.promise();
+				if (promise.Continuation)
+					return promise.Continuation;
+
+				promise.Done.CountDown();
+				return std::noop_coroutine();
+			}
+
+			void await_resume() const noexcept {}
+		};
+
+		struct Awaiter
+		{
+			Handle Coroutine;
+
+			bool await_ready() const noexcept { return false; }
+
+			// starts the task on this thread, we are resumed when it finishes
+			std::coroutine_handle<> await_suspend(std::coroutine_handle<> handle) noexcept
+			{
+				Coroutine.promise().Continuation = handle;
+				return Coroutine;
+			}
+
+			R await_resume() 
+			{ 
+				if (Coroutine.promise().Error) 
+					std::rethrow_exception(Coroutine.promise().Error);
+
+				return Coroutine.promise().Take(); 
+			}
+		};
+
+		Handle Coroutine;
+
+		explicit Task(Handle coroutine) : Coroutine(coroutine) {}
+
+	public:
+
+		struct promise_type : public PromiseResult<R>
+		{
+			// resumed when the task finishes, null when Get is waiting for it instead
+			std::coroutine_handle<> Continuation;
+			JobLatch Done { 1 };
+
+			Task get_return_object() { return Task(Handle::from_promise(*this)); }
+
+			std::suspend_always initial_suspend() const noexcept { return {}; }
+			FinalAwaiter final_suspend() const noexcept { return {}; }
+
+			// rethrown to whoever awaits the task or calls Get
+			std::exception_ptr Error;
+
+			void unhandled_exception() { Error = std::current_exception(); }
+		};
+
+		Task() = default;
+		Task(const Task&) = delete;
+		Task& operator=(const Task&) = delete;
+
+		Task(Task&& other) noexcept : Coroutine(other.Coroutine) { other.Coroutine = nullptr; }
+
+		Task& operator=(Task&& other) noexcept
+		{
+			if (this != &other)
+			{
+				if (Coroutine) Coroutine.destroy();
+				Coroutine = other.Coroutine;
+				other.Coroutine = nullptr;
+			}
+
+			return *this;
+		}
+
+		~Task()
+		{
+			if (Coroutine) Coroutine.destroy();
+		}
+
+		bool IsValid() const { return Coroutine != nullptr; }
+
+		// a task can only be awaited once, and not after Get
+		Awaiter operator co_await() noexcept { return Awaiter { Coroutine }; }
+
+		// starts the task on this thread and blocks until it is done, for callers that aren't coroutines
+		// a pool thread keeps running jobs from its pool while it waits
+		R Get()
+		{
+			Coroutine.resume();
+
+			JobLatch& done = Coroutine.promise().Done;
+			if (KThreadPool* pool = GetCurrentPool())
+			{
+				pool->WaitForLatch(done);
+			}
+			else
+			{
+				uint32_t remaining;
+				while ((remaining = done.Remaining.load(std::memory_order_acquire)) != 0)
+					done.Remaining.wait(remaining);
+			}
+
+			if (Coroutine.promise().Error) 
+				std::rethrow_exception(Coroutine.promise().Error);
+
+			return Coroutine.promise().Take();
+		}
+	};
+
+	KThreadPool() = default;
+	~KThreadPool()
+	{
+		bDestroyingPool = true; // allows threads to exit when they finish
+
+		if (ElasticThread.joinable())
+		{
+			{
+				std::lock_guard<std::mutex> lock(ElasticMutex);
+			}
+
+			ElasticCondition.notify_all();
+			ElasticThread.join();
+		}
+
+		// release any parked threads so they can see the destroy flag
+		WakeEpoch++;
+		WakeEpoch.notify_all();
+
+		for (std::thread& t : Threads) 
+		{
+			if (t.joinable()) 
+				t.join();
+		}
+	}
+
+	// count - number of threads in the pool, set to 0 to use DefaultThreadCount	
+	// restTime - time threads sleep between checks for new jobs to be posted
+	//    when 0 idle threads spin briefly and then park until a job is added, which is preferred in almost all cases
+	KThreadPool(int count = 0, double restTime = 0)
+		: KThreadPool(PoolOptions { .ThreadCount = count, .RestTime = restTime }) {}
+
+	KThreadPool(const PoolOptions& options)
+		: RestTime(options.RestTime), Order(options.Order), Backpressure(options.Backpressure)
+	{
+		if (options.QueueCapacity > 0)
+		{
+			BoundedLanes.reset(new BoundedJobQueue[(size_t)EJobPriority::Count]);
+			for (size_t lane = 0; lane < (size_t)EJobPriority::Count; lane++)
+				BoundedLanes[lane].Init(options.QueueCapacity);
+		}
+
+		int count = options.ThreadCount;
+
+		if (count == 0)
+			count = DefaultThreadCount != 0 ? DefaultThreadCount : options.bPhysicalCores ? GetPhysicalCoreCount() : GetAvailableCpuCount();
+
+		if (count <= 0) 
+			count = 1;
+
+		const int maxCount = options.MaxThreadCount > 0 ? options.MaxThreadCount : GetAvailableCpuCount();
+		const int capacity = maxCount > count ? maxCount : count;
+
+		Threads.resize(capacity);
+		Workers.reserve(capacity);
+
+		for (int i = 0; i < capacity; i++)
+		{
+			Workers.push_back(std::make_unique<Worker>());
+			Workers[i]->Pool = this;
+			Workers[i]->Index = i;
+			Workers[i]->StealCursor = i + 1;
+			Workers[i]->Scratch.Reserve(options.ScratchSize);
+		}
+
+		if (options.Affinity != EAffinity::None)
+			PlaceWorkers(options.Affinity);
+
+		SetThreadCount(count);
+
+		if (options.bElastic)
+		{
+			const int minCount = options.MinThreadCount > 0 ? options.MinThreadCount : 1;
+			ElasticThread = std::thread(&KThreadPool::RunElastic, this, minCount, options.ElasticInterval, options.ElasticIdleTimeout);
+		}
+	}
+
+	// change the number of threads, clamped to [1, GetMaxThreadCount()], returns the count that was applied
+	// extra threads aren't stopped right away, each one returns the next time it runs out of jobs
+	// can be called from any thread, including the pool's own
+	int SetThreadCount(int count)
+	{
+		const int capacity = (int)Workers.size();
+		if (count < 1) count = 1;
+		if (count > capacity) count = capacity;
+
+		std::lock_guard<std::mutex> lock(ResizeMutex);
+
+		for (int i = 0; i < capacity; i++)
+		{
+			Worker& worker = *Workers[i];
+
+			if (i < count)
+			{
+				// a retiring thread that hasn't gone yet just carries on
+				EWorkerState expected = EWorkerState::Retiring;
+				if (worker.State.compare_exchange_strong(expected, EWorkerState::Running) || expected == EWorkerState::Running)
+					continue;
+
+				// the thread that was here before has returned or is about to
+				if (Threads[i].joinable())
+					Threads[i].join();
+
+				worker.State = EWorkerState::Running;
+				if ((size_t)i >= StartedWorkerCount.load()) StartedWorkerCount = i + 1;
+
+				Threads[i] = std::thread(&KThreadPool::RunWorker, this, (size_t)i);
+			}
+			else
+			{
+				EWorkerState expected = EWorkerState::Running;
+				worker.State.compare_exchange_strong(expected, EWorkerState::Retiring);
+			}
+		}
+
+		const int previous = ThreadCount.exchange(count);
+
+		// parked threads have to wake up to notice they are retiring
+		if (count < previous)
+		{
+			WakeEpoch++;
+			WakeEpoch.notify_all();
+		}
+
+		return count;
+	}
+
+private:
+
+	// keeps a thread alive while waiting for a new job to consume
+	void RunWorker(size_t threadIndex)
+	{
+		CurrentWorker = Workers[threadIndex].get();
+		SetThreadAffinity(CurrentWorker->Cpus);
+
+		while (true)
+		{
+			// read before checking the queue so a job posted after the check is never missed
+			const uint32_t epoch = WakeEpoch.load();
+
+			if (TakeNewJob())
+				continue;
+
+			// the thread that finishes the last job always ends up here, so it's the one that wakes WaitForFinish
+			NotifyIfFinished();
+
+			if (IsPendingDestroy())
+				return;
+
+			// only returns once out of jobs, so nothing is left in this worker's deque
+			EWorkerState retiring = EWorkerState::Retiring;
+			if (CurrentWorker->State.compare_exchange_strong(retiring, EWorkerState::Stopped))
+				return;
+
+#ifdef KTHREADPOOL_STATS
+			const uint64_t idleStart = ClockNanoseconds();
+#endif
+
+			if (RestTime > 0)
+			{
+				std::this_thread::sleep_for(std::chrono::duration<double>(RestTime));
+			}
+			else
+			{
+				WaitForWake(epoch);
+			}
+
+#ifdef KTHREADPOOL_STATS
+			CurrentWorker->Stats.IdleNanoseconds.fetch_add(ClockNanoseconds() - idleStart, std::memory_order_relaxed);
+#endif
+		}
+	}
+
+	// elastic scaling, samples the pool every interval until it's destroyed
+	void RunElastic(int minCount, double interval, double idleTimeout)
+	{
+		const auto wait = std::chrono::duration<double>(interval > 0 ? interval : .01);
+
+		int backlogSamples = 0;
+		double idleSeconds = 0;
+
+		std::unique_lock<std::mutex> lock(ElasticMutex);
+		while (!ElasticCondition.wait_for(lock, wait, [this]() -> bool { return IsPendingDestroy(); }))
+		{
+			const int count = GetThreadCount();
+			const bool bIdle = ParkedCount.load() > 0;
+			const bool bBacklog = !bIdle && GetPendingJobCount() > 0;
+
+			// jobs waited a whole interval with every thread busy
+			backlogSamples = bBacklog ? backlogSamples + 1 : 0;
+			if (backlogSamples >= 2 && count < GetMaxThreadCount())
+			{
+				SetThreadCount(count + 1);
+				backlogSamples = 0;
+			}
+
+			idleSeconds = bIdle ? idleSeconds + wait.count() : 0;
+			if (idleSeconds >= idleTimeout && count > minCount)
+			{
+				SetThreadCount(count - 1);
+				idleSeconds = 0;
+			}
+		}
+	}
+
+	void AddJobToPool(ThreadJobBase* job)
+	{
+		CountAddedJobs(1);
+		PostJob(job);
+
+		// pool threads waiting in WaitForFinish park on HelpEpoch, wake them once the job can be taken
+		if (HelpingWaiterCount.load() > 0)
+			WakeHelpers();
+	}
+
+	// count jobs as unfinished in the calling thread's tally, before they are posted
+	// seq_cst so either a waiter registering in FinishWaiterCount or HelpingWaiterCount sees the add, or we see the waiter
+	void CountAddedJobs(size_t count)
+	{
+		Worker* worker = GetLocalWorker();
+		(worker ? worker->Jobs : ExternalJobs).Added.fetch_add(count);
+	}
+
+	// number of jobs added but not finished, pending and running
+	// every finished count is read before any added count, since a job's add happens before its finish
+	//    every finish seen has its add seen too, so a total of zero means there was a moment with no unfinished job
+	// reads one line per worker the pool can grow to, so it's only called by waiters and by threads looking for one to wake
+	size_t GetUnfinishedJobCount() const
+	{
+		size_t finished = ExternalJobs.Finished.load();
+		for (const std::unique_ptr<Worker>& worker : Workers)
+			finished += worker->Jobs.Finished.load();
+
+		size_t added = ExternalJobs.Added.load();
+		for (const std::unique_ptr<Worker>& worker : Workers)
+			added += worker->Jobs.Added.load();
+
+		return added - finished;
+	}
+
+	void WakeHelpers()
+	{
+		HelpEpoch++;
+		HelpEpoch.notify_all();
+	}
+
+	// wake WaitForFinish if every job has finished
+	// pool threads call this when they run out of jobs rather than after every job, the last one to finish always runs out
+	void NotifyIfFinished()
+	{
+		if (FinishWaiterCount.load() > 0 && GetUnfinishedJobCount() == 0)
+		{
+			// taking the lock guarantees the waiter is either asleep or has not checked yet
+			std::lock_guard<std::mutex> lock(FinishMutex);
+			FinishCondition.notify_all();
+		}
+	}
+
+	// count and queue a batch of jobs with the same priority, taking QueueMutex and waking threads once for all of them
+	void AddJobsToPool(ThreadJobBase* const* jobs, size_t count)
+	{
+		if (count == 0) return;
+
+		CountAddedJobs(count);
+
+#ifdef KTHREADPOOL_STATS
+		const uint64_t queuedTime = ClockNanoseconds();
+		for (size_t i = 0; i < count; i++)
+			jobs[i]->QueuedTime = queuedTime;
+#endif
+
+		Worker* worker = GetLocalWorker();
+		const EJobPriority priority = jobs[0]->Priority;
+		if (worker && priority == EJobPriority::Normal)
+		{
+			for (size_t i = 0; i < count; i++)
+				worker->LocalJobs.Push(jobs[i]);
+
+#ifdef KTHREADPOOL_STATS
+			RecordPeak(worker->Stats.PeakLocalQueueDepth, worker->LocalJobs.Size());
+#endif
+		}
+		else
+		{
+			const size_t lane = (size_t)priority;
+
+			// fill the bounded lane first, whatever doesn't fit goes to PendingJobs
+			size_t pushed = 0;
+			if (BoundedLanes)
+			{
+				while (pushed < count && BoundedLanes[lane].Push(jobs[pushed]))
+					pushed++;
+			}
+
+			if (pushed < count)
+			{
+				std::lock_guard<std::mutex> lock(QueueMutex);
+				PendingJobs[lane].insert(PendingJobs[lane].end(), jobs + pushed, jobs + count);
+				PendingJobsSize[lane] = PendingJobs[lane].size();
+
+#ifdef KTHREADPOOL_STATS
+				RecordPeak(PeakQueueDepth, PendingJobs[lane].size());
+#endif
+			}
+		}
+
+		WakeThreads(count);
+
+		if (HelpingWaiterCount.load() > 0)
+			WakeHelpers();
+	}
+
+	// queue a job that has already been counted as added
+	// a full bounded lane spills into PendingJobs, unless bAllowOverflow is false, then it returns false instead
+	bool PostJob(ThreadJobBase* job, bool bAllowOverflow = true)
+	{
+#ifdef KTHREADPOOL_STATS
+		job->QueuedTime = ClockNanoseconds();
+#endif
+
+		// the job can run and be gone as soon as it's pushed, so nothing below reads it afterward
+		const size_t lane = (size_t)job->Priority;
+
+		Worker* worker = GetLocalWorker();
+		if (worker && job->Priority == EJobPriority::Normal)
+		{
+			// added from one of our own jobs, keep it on this thread unless someone steals it
+			worker->LocalJobs.Push(job);
+
+#ifdef KTHREADPOOL_STATS
+			RecordPeak(worker->Stats.PeakLocalQueueDepth, worker->LocalJobs.Size());
+#endif
+		}
+		else if (BoundedLanes && BoundedLanes[lane].Push(job))
+		{
+#ifdef KTHREADPOOL_STATS
+			RecordPeak(PeakQueueDepth, BoundedLanes[lane].Size());
+#endif
+		}
+		else if (!bAllowOverflow)
+		{
+			return false;
+		}
+		else
+		{
+			std::lock_guard<std::mutex> lock(QueueMutex);
+			PendingJobs[lane].push_back(job);
+			PendingJobsSize[lane] = PendingJobs[lane].size();
+
+#ifdef KTHREADPOOL_STATS
+			RecordPeak(PeakQueueDepth, PendingJobs[lane].size());
+#endif
+		}
+
+		WakeThreads(1);
+		return true;
+	}
+
+	// AddJobToPool for jobs added by the user, full bounded lanes are handled by policy
+	// returns false if the job was dropped
+	bool SubmitJobToPool(ThreadJobBase* job, EBackpressure policy)
+	{
+		if (!BoundedLanes)
+		{
+			AddJobToPool(job);
+			return true;
+		}
+
+		CountAddedJobs(1);
+
+		// a pool thread never waits for space, every thread that could make some might be waiting too
+		Worker* worker = GetLocalWorker();
+		const bool bWaits = policy == EBackpressure::Block || policy == EBackpressure::Spin;
+
+		int spins = 0;
+		while (!PostJob(job, false))
+		{
+			if (worker && bWaits)
+			{
+				PostJob(job);
+				break;
+			}
+
+			if (policy == EBackpressure::Fail)
+			{
+				DestroyJob(job);
+				FinishJobs(1);
+				return false;
+			}
+
+			if (policy == EBackpressure::RunInline)
+			{
+				RunJob(worker, job);
+				return true;
+			}
+
+			if (++spins < IdleSpinCount)
+			{
+				CpuRelax();
+				continue;
+			}
+
+			// spinning past the idle spin count gives the time slice away, the consumers may share our core
+			if (policy == EBackpressure::Spin)
+			{
+				std::this_thread::yield();
+				continue;
+			}
+
+			// announce ourselves before the last check so a consumer either sees us or we see its space
+			const uint32_t epoch = SpaceEpoch.load();
+			BlockedProducerCount++;
+			std::atomic_thread_fence(std::memory_order_seq_cst);
+
+			const bool bPosted = PostJob(job, false);
+			if (!bPosted) SpaceEpoch.wait(epoch);
+
+			BlockedProducerCount--;
+			if (bPosted) break;
+		}
+
+		if (HelpingWaiterCount.load() > 0)
+			WakeHelpers();
+
+		return true;
+	}
+
+	// the calling thread's worker if it belongs to this pool
+	Worker* GetLocalWorker()
+	{
+		Worker* worker = CurrentWorker;
+		return worker && worker->Pool == this ? worker : nullptr;
+	}
+
+	// signal that count jobs were posted, waking up to that many parked threads
+	void WakeThreads(size_t count)
+	{
+		WakeEpoch++;
+
+		// the epoch bump above and the increment in WaitForWake are both seq_cst,
+		//    so either we see the parked thread here or it sees the new epoch and doesn't sleep
+		const int parked = ParkedCount.load();
+		if (parked > 0)
+		{
+			if (count >= (size_t)parked)
+			{
+				WakeEpoch.notify_all();
+			}
+			else
+			{
+				for (size_t i = 0; i < count; i++)
+					WakeEpoch.notify_one();
+			}
+		}
+	}
+
+	// idle thread waits for the epoch to move past the value it read before its last failed check
+	void WaitForWake(uint32_t epoch)
+	{
+		for (int i = 0; i < IdleSpinCount; i++)
+		{
+			if (WakeEpoch.load(std::memory_order_relaxed) != epoch) 
+				return;
+
+			CpuRelax();
+		}
+
+		ParkedCount++;
+		WakeEpoch.wait(epoch);
+		ParkedCount--;
+	}
+
+#if defined(KTHREADPOOL_STATS) || defined(KTHREADPOOL_TRACE)
+	static uint64_t ClockNanoseconds()
+	{
+		return (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+	}
+#endif
+
+#ifdef KTHREADPOOL_TRACE
+	void RecordTrace(const TraceEvent& event)
+	{
+		if (Worker* worker = GetLocalWorker())
+		{
+			worker->Trace.Record(event);
+		}
+		else
+		{
+			std::lock_guard<std::mutex> lock(ExternalTraceMutex);
+			ExternalTrace.Record(event);
+		}
+	}
+
+	// event name with the characters JSON strings can't hold escaped
+	static std::string EscapeTraceLabel(const TraceEvent& event)
+	{
+		static const char* const typeNames[] = { "Job", "Iterate chunk", "Weighted section" };
+		const char* label = event.Label ? event.Label : typeNames[(size_t)event.Type];
+
+		std::string escaped;
+		for (const char* c = label; *c; c++)
+		{
+			if (*c == '"' || *c == '\\') escaped += '\\';
+			if ((unsigned char)*c >= 0x20) escaped += *c;
+		}
+
+		return escaped;
+	}
+#endif
+
+#ifdef KTHREADPOOL_STATS
+	static size_t HistogramBucket(uint64_t nanoseconds)
+	{
+		const size_t bucket = nanoseconds == 0 ? 0 : (size_t)std::bit_width(nanoseconds) - 1;
+		return bucket < HistogramBucketCount ? bucket : HistogramBucketCount - 1;
+	}
+
+	// raise peak to value if value is larger
+	static void RecordPeak(std::atomic<size_t>& peak, size_t value)
+	{
+		size_t current = peak.load(std::memory_order_relaxed);
+		while (value > current && !peak.compare_exchange_weak(current, value, std::memory_order_relaxed)) {}
+	}
+#endif
+
+	// hint to the CPU that we are in a spin loop
+	static void CpuRelax()
+	{
+#if defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+		_mm_pause();
+#elif defined(__x86_64__) || defined(__i386__)
+		__builtin_ia32_pause();
+#elif defined(__aarch64__)
+		asm volatile("yield");
+#else
+		std::this_thread::yield();
+#endif
+	}
+
+	// take a job from one of the PendingJobs lanes, bOldest ignores Order and takes from the front
+	ThreadJobBase* TakePendingJob(EJobPriority priority, bool bOldest = false)
+	{
+		const size_t lane = (size_t)priority;
+
+		if (BoundedLanes)
+		{
+			if (ThreadJobBase* job = BoundedLanes[lane].Pop())
+			{
+				// the fence pairs with the one in SubmitJobToPool, either we see the blocked producer or it sees the space
+				std::atomic_thread_fence(std::memory_order_seq_cst);
+				if (BlockedProducerCount.load(std::memory_order_relaxed) > 0)
+				{
+					SpaceEpoch++;
+					SpaceEpoch.notify_all();
+				}
+
+				return job;
+			}
+		}
+
+		if (PendingJobsSize[lane].load(std::memory_order_relaxed) == 0)
+			return nullptr;
+
+		std::lock_guard<std::mutex> lock(QueueMutex);
+		std::deque<ThreadJobBase*>& jobs = PendingJobs[lane];
+		if (jobs.size() > 0)
+		{
+			ThreadJobBase* job = nullptr;
+			if (bOldest || Order == EQueueOrder::Fifo)
+			{
+				job = jobs.front();
+				jobs.pop_front();
+			}
+			else
+			{
+				job = jobs.back();
+				jobs.pop_back();
+			}
+
+			PendingJobsSize[lane] = jobs.size();
+			return job;
+		}
+
+		return nullptr;
+	}
+
+	// take the oldest job in the lowest priority lane that has one
+	ThreadJobBase* TakeStarvedJob()
+	{
+		for (size_t lane = (size_t)EJobPriority::Count; lane-- > 0;)
+		{
+			if (ThreadJobBase* job = TakePendingJob((EJobPriority)lane, true))
+				return job;
+		}
+
+		return nullptr;
+	}
+
+	// take the oldest job from another worker's deque
+	// threads placed on NUMA nodes try the workers on their own node first
+	ThreadJobBase* StealJob(Worker* thief)
+	{
+		const size_t count = StartedWorkerCount.load(std::memory_order_relaxed);
+		const size_t start = thief ? thief->StealCursor++ : 0;
+		const bool bByNode = NodeCount > 1 && thief;
+
+		for (int pass = 0; pass < (bByNode ? 2 : 1); pass++)
+		{
+			for (size_t i = 0; i < count; i++)
+			{
+				Worker* victim = Workers[(start + i) % count].get();
+				if (victim == thief) continue;
+				if (bByNode && (victim->Node == thief->Node) != (pass == 0)) continue;
+
+				if (ThreadJobBase* job = victim->LocalJobs.Steal())
+					return job;
+			}
+		}
+
+		return nullptr;
+	}
+
+	// thread attempts to get the next job from the pool
+	// looks at high priority jobs first, then its own deque, then normal jobs added from outside,
+	//    then steals from other workers, and finally takes background jobs
+	bool TakeNewJob()
+	{
+		Worker* worker = GetLocalWorker();
+		ThreadJobBase* job = nullptr;
+
+		if (worker && ++worker->TakeCount % StarvationInterval == 0)
+			job = TakeStarvedJob();
+
+		if (!job) job = TakePendingJob(EJobPriority::High);
+
+		if (!job && worker)
+		{
+			// the owner of a deque can steal from itself to get the oldest job
+			job = Order == EQueueOrder::Fifo ? worker->LocalJobs.Steal() : worker->LocalJobs.Pop();
+		}
+
+		if (!job) job = TakePendingJob(EJobPriority::Normal);
+
+		if (!job)
+		{
+			job = StealJob(worker);
+
+#ifdef KTHREADPOOL_STATS
+			if (job && worker) worker->Stats.StolenJobs.fetch_add(1, std::memory_order_relaxed);
+#endif
+		}
+
+		if (!job) job = TakePendingJob(EJobPriority::Background);
+
+		if (job)
+		{
+			RunJob(worker, job);
+			return true;
+		}
+
+		return false;
+	}
+
+	// run a job that was taken from the pool, or never made it into the pool when run inline
+	void RunJob(Worker* worker, ThreadJobBase* job)
+	{
+		// counted per worker rather than in one shared counter every job would write to
+		std::atomic<uint32_t>* depth = worker ? &worker->JobDepth : nullptr;
+		if (depth) depth->store(depth->load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+
+#ifdef KTHREADPOOL_STATS
+		const uint64_t startTime = ClockNanoseconds();
+		const uint64_t queuedTime = job->QueuedTime;
+#endif
+
+#ifdef KTHREADPOOL_TRACE
+		const char* outerLabel = CurrentTraceLabel;
+		CurrentTraceLabel = nullptr;
+
+		TraceEvent event;
+		event.Start = ClockNanoseconds();
+#endif
+
+		ScratchArena& scratch = worker ? worker->Scratch : GetExternalScratch();
+		const ScratchArena::Mark scratchMark = scratch.GetMark();
+
+		// try is free until something throws, a job that does still finishes and the thread carries on
+		const bool bEmbedded = job->bEmbedded;
+		try
+		{
+			job->Execute();
+		}
+		catch (...)
+		{
+			if (bEmbedded || !job->CaptureException(std::current_exception()))
+				JobErrors.Capture(std::current_exception());
+		}
+
+		scratch.Rewind(scratchMark);
+		if (!bEmbedded && job->Release()) DestroyJob(job);
+
+#ifdef KTHREADPOOL_TRACE
+		event.End = ClockNanoseconds();
+		event.Label = CurrentTraceLabel;
+		RecordTrace(event);
+
+		CurrentTraceLabel = outerLabel;
+#endif
+
+#ifdef KTHREADPOOL_STATS
+		if (worker)
+		{
+			const uint64_t executeTime = ClockNanoseconds() - startTime;
+			WorkerCounters& stats = worker->Stats;
+			stats.ExecutedJobs.fetch_add(1, std::memory_order_relaxed);
+			stats.BusyNanoseconds.fetch_add(executeTime, std::memory_order_relaxed);
+			stats.ExecutionTime[HistogramBucket(executeTime)].fetch_add(1, std::memory_order_relaxed);
+			stats.QueueLatency[HistogramBucket(startTime > queuedTime ? startTime - queuedTime : 0)].fetch_add(1, std::memory_order_relaxed);
+		}
+#endif
+
+		if (depth) depth->store(depth->load(std::memory_order_relaxed) - 1, std::memory_order_relaxed);
+		FinishJobs(worker, 1);
+	}
+
+	// drop a job that was counted as added without running it
+	void DiscardJob(ThreadJobBase* job)
+	{
+		job->Abandon();
+		if (job->Release()) DestroyJob(job);
+		FinishJobs(1);
+	}
+
+	// mark count jobs as finished in the calling thread's tally
+	void FinishJobs(size_t count) { FinishJobs(GetLocalWorker(), count); }
+
+	void FinishJobs(Worker* worker, size_t count)
+	{
+		// the add here and the increments in the waits are all seq_cst,
+		//    so either we see the waiter or the waiter's sum sees this finish
+		(worker ? worker->Jobs : ExternalJobs).Finished.fetch_add(count);
+
+		// a pool thread looks for a waiter to wake once it runs out of jobs, anyone else has to look now
+		if (!worker) NotifyIfFinished();
+
+		if (HelpingWaiterCount.load() > 0)
+			WakeHelpers();
+	}
+
+	// WaitForFinish called from one of this pool's jobs
+	// the calling job and any job below it on this thread's stack can't finish until we return,
+	//    so they are counted as waiting and excluded, and the thread runs other jobs instead of blocking
+	// parks on the unfinished count when there is nothing to run, returns false if deadline passes first
+	template <typename Clock, typename Duration>
+	bool HelpForFinish(Worker* worker, const std::chrono::time_point<Clock, Duration>* deadline)
+	{
+		const uint32_t jobDepth = worker->JobDepth.load(std::memory_order_relaxed);
+		const uint32_t waitingDepth = worker->WaitingDepth;
+		const size_t waiting = jobDepth - waitingDepth;
+		worker->WaitingDepth = jobDepth;
+		HelpingWaiterCount += waiting;
+
+		bool bFinished = true;
+		int spins = 0;
+		while (true)
+		{
+			// a job we could take was still unfinished, so the tallies are only summed once there is nothing to take
+			if (TakeNewJob())
+			{
+				spins = 0;
+				continue;
+			}
+
+			const uint32_t epoch = HelpEpoch.load();
+			if (GetUnfinishedJobCount() <= HelpingWaiterCount.load())
+				break;
+
+			if (deadline && Clock::now() >= *deadline)
+			{
+				bFinished = false;
+				break;
+			}
+			else if (++spins < IdleSpinCount)
+			{
+				CpuRelax();
+			}
+			else if (deadline)
+			{
+				std::this_thread::yield();
+			}
+			else
+			{
+				HelpEpoch.wait(epoch);
+			}
+		}
+
+		HelpingWaiterCount -= waiting;
+		worker->WaitingDepth = waitingDepth;
+
+		// waiters further up the stack may now be able to finish
+		WakeHelpers();
+
+		return bFinished;
+	}
+
+	// spin briefly on the unfinished count, returns true if it reached zero
+	bool SpinForFinish()
+	{
+		for (int i = 0; i < IdleSpinCount; i++)
+		{
+			if (GetUnfinishedJobCount() == 0)
+				return true;
+
+			CpuRelax();
+		}
+
+		return false;
+	}
+
+public:
+
+	// number of hardware threads on the CPU
+	static int GetCpuCoreCount()
+	{
+		return (int)std::thread::hardware_concurrency();
+	}
+
+	// number of hardware threads this process can actually use, limited by its affinity mask and any container CPU quota
+	static int GetAvailableCpuCount()
+	{
+		const int count = (int)GetCpuTopology().size();
+		const int quota = GetCpuQuota();
+		return quota > 0 && quota < count ? quota : count;
+	}
+
+	// same as GetAvailableCpuCount but hyperthread siblings only count once
+	static int GetPhysicalCoreCount()
+	{
+		std::vector<int> cores;
+		for (const CpuInfo& cpu : GetCpuTopology())
+			cores.push_back(cpu.Core);
+
+		std::sort(cores.begin(), cores.end());
+		const int count = (int)(std::unique(cores.begin(), cores.end()) - cores.begin());
+		const int quota = GetCpuQuota();
+		return quota > 0 && quota < count ? quota : count;
+	}
+
+	// number of NUMA nodes this pool's threads are spread over
+	size_t GetNodeCount() const { return NodeCount; }
+
+	// add a function to the pool to be processed by the next available thread
+	// returns false if the pool has a bounded queue that was full and its backpressure is Fail
+	template <typename Functor, typename... TArgs>
+	bool AddFunctionToPool(Functor&& func, TArgs&&... args)
+	{
+		return AddFunctionToPool(EJobPriority::Normal, std::forward<Functor>(func), std::forward<TArgs>(args)...);
+	}
+
+	// same as above but queued in the lane for priority
+	template <typename Functor, typename... TArgs>
+	bool AddFunctionToPool(EJobPriority priority, Functor&& func, TArgs&&... args)
+	{
+		typedef ThreadJob<typename std::decay<Functor>::type, typename std::decay<TArgs>::type...> Job;
+
+		Job* job = MakeJob<Job>(std::forward<Functor>(func), std::forward<TArgs>(args)...);
+		job->Priority = priority;
+		job->bDiscardable = true;
+		return SubmitJobToPool(job, Backpressure);
+	}
+
+	// add a function only if its lane's bounded queue has room, whatever the pool's backpressure is
+	template <typename Functor, typename... TArgs>
+	bool TryAddFunctionToPool(Functor&& func, TArgs&&... args)
+	{
+		return TryAddFunctionToPool(EJobPriority::Normal, std::forward<Functor>(func), std::forward<TArgs>(args)...);
+	}
+
+	template <typename Functor, typename... TArgs>
+	bool TryAddFunctionToPool(EJobPriority priority, Functor&& func, TArgs&&... args)
+	{
+		typedef ThreadJob<typename std::decay<Functor>::type, typename std::decay<TArgs>::type...> Job;
+
+		Job* job = MakeJob<Job>(std::forward<Functor>(func), std::forward<TArgs>(args)...);
+		job->Priority = priority;
+		job->bDiscardable = true;
+		return SubmitJobToPool(job, EBackpressure::Fail);
+	}
+
+	// add a job running func(item) for every item in items, the whole batch is queued under one lock with one wakeup
+	// items are copied into the jobs, or moved when items is an rvalue
+	// returns how many were added, fewer than the item count only when a bounded queue dropped some
+	template <typename Functor, typename Range>
+	size_t AddFunctionsToPool(Functor&& func, Range&& items)
+	{
+		return AddFunctionsToPool(EJobPriority::Normal, std::forward<Functor>(func), std::forward<Range>(items));
+	}
+
+	// same as above but queued in the lane for priority
+	template <typename Functor, typename Range>
+	size_t AddFunctionsToPool(EJobPriority priority, Functor&& func, Range&& items)
+	{
+		typedef typename std::decay<decltype(*std::begin(items))>::type T;
+		typedef ThreadJob<typename std::decay<Functor>::type, T> Job;
+
+		std::vector<ThreadJobBase*> jobs;
+		for (auto&& item : items)
+		{
+			Job* job = MakeBatchJob<Job, Range>(item, func);
+			job->Priority = priority;
+			job->bDiscardable = true;
+			jobs.push_back(job);
+		}
+
+		if (!BoundedLanes)
+		{
+			AddJobsToPool(jobs.data(), jobs.size());
+			return jobs.size();
+		}
+
+		// each job goes through backpressure on its own
+		size_t added = 0;
+		for (ThreadJobBase* job : jobs)
+			added += SubmitJobToPool(job, Backpressure);
+
+		return added;
+	}
+
+	// same as AddFunctionsToPool but returns a Future for each job, in the same order as items
+	template <typename Functor, typename Range>
+	auto SubmitBatch(Functor&& func, Range&& items)
+	{
+		return SubmitBatch(EJobPriority::Normal, std::forward<Functor>(func), std::forward<Range>(items));
+	}
+
+	template <typename Functor, typename Range>
+	auto SubmitBatch(EJobPriority priority, Functor&& func, Range&& items)
+	{
+		typedef typename std::decay<Functor>::type F;
+		typedef typename std::decay<decltype(*std::begin(items))>::type T;
+		typedef JobResult<F, T> R;
+		typedef SubmitJob<R, F, T> Job;
+
+		std::vector<ThreadJobBase*> jobs;
+		std::vector<Future<R>> futures;
+		for (auto&& item : items)
+		{
+			Job* job = MakeBatchJob<Job, Range>(item, this, func);
+			job->Priority = priority;
+			job->bDiscardable = true;
+			jobs.push_back(job);
+			futures.push_back(Future<R>(job));
+		}
+
+		if (!BoundedLanes)
+		{
+			AddJobsToPool(jobs.data(), jobs.size());
+			return futures;
+		}
+
+		// a dropped job leaves its future invalid, the job is already gone so it isn't released
+		for (size_t i = 0; i < jobs.size(); i++)
+		{
+			if (!SubmitJobToPool(jobs[i], Backpressure))
+				futures[i].State = nullptr;
+		}
+
+		return futures;
+	}
+
+	// add a function to the pool and get a Future for its return value
+	template <typename Functor, typename... TArgs>
+	auto Submit(Functor&& func, TArgs&&... args)
+	{
+		return Submit(EJobPriority::Normal, std::forward<Functor>(func), std::forward<TArgs>(args)...);
+	}
+
+	// same as above but queued in the lane for priority, continuations added with Then use the same priority
+	template <typename Functor, typename... TArgs>
+	auto Submit(EJobPriority priority, Functor&& func, TArgs&&... args)
+	{
+		typedef typename std::decay<Functor>::type F;
+		typedef JobResult<F, typename std::decay<TArgs>::type...> R;
+		typedef SubmitJob<R, F, typename std::decay<TArgs>::type...> Job;
+
+		Job* job = MakeJob<Job>(this, std::forward<Functor>(func), std::forward<TArgs>(args)...);
+		job->Priority = priority;
+		job->bDiscardable = true;
+
+		// dropped by a full bounded queue, the future is invalid
+		if (!SubmitJobToPool(job, Backpressure))
+			return Future<R>();
+
+		return Future<R>(job);
+	}
+
+	// awaitable that resumes the awaiting coroutine on one of this pool's threads
+	ScheduleAwaiter Schedule(EJobPriority priority = EJobPriority::Normal)
+	{
+		return ScheduleAwaiter(this, priority);
+	}
+
+	bool IsPendingDestroy() { return bDestroyingPool; }
+
+	// number of jobs currently running, summed from every thread's own count so approximate while the pool is running
+	size_t GetActiveJobCount() const
+	{
+		size_t count = 0;
+		for (const std::unique_ptr<Worker>& worker : Workers)
+			count += worker->JobDepth.load(std::memory_order_relaxed);
+
+		return count;
+	}
+
+#ifdef KTHREADPOOL_STATS
+	// counters since the pool started or the last ResetStats
+	PoolStats GetStats() const
+	{
+		PoolStats result;
+		result.PeakQueueDepth = PeakQueueDepth.load(std::memory_order_relaxed);
+
+		for (const std::unique_ptr<Worker>& worker : Workers)
+		{
+			const WorkerCounters& stats = worker->Stats;
+
+			WorkerStats& workerStats = result.Workers.emplace_back();
+			workerStats.ExecutedJobs = stats.ExecutedJobs.load(std::memory_order_relaxed);
+			workerStats.StolenJobs = stats.StolenJobs.load(std::memory_order_relaxed);
+			workerStats.IdleSeconds = stats.IdleNanoseconds.load(std::memory_order_relaxed) * 1e-9;
+			workerStats.BusySeconds = stats.BusyNanoseconds.load(std::memory_order_relaxed) * 1e-9;
+			workerStats.PeakLocalQueueDepth = stats.PeakLocalQueueDepth.load(std::memory_order_relaxed);
+
+			for (size_t i = 0; i < HistogramBucketCount; i++)
+			{
+				result.QueueLatency[i] += stats.QueueLatency[i].load(std::memory_order_relaxed);
+				result.ExecutionTime[i] += stats.ExecutionTime[i].load(std::memory_order_relaxed);
+			}
+		}
+
+		return result;
+	}
+
+	// zero every counter, jobs running at the time may still be counted afterward
+	void ResetStats()
+	{
+		PeakQueueDepth.store(0, std::memory_order_relaxed);
+
+		for (const std::unique_ptr<Worker>& worker : Workers)
+		{
+			WorkerCounters& stats = worker->Stats;
+			stats.ExecutedJobs.store(0, std::memory_order_relaxed);
+			stats.StolenJobs.store(0, std::memory_order_relaxed);
+			stats.IdleNanoseconds.store(0, std::memory_order_relaxed);
+			stats.BusyNanoseconds.store(0, std::memory_order_relaxed);
+			stats.PeakLocalQueueDepth.store(0, std::memory_order_relaxed);
+
+			for (size_t i = 0; i < HistogramBucketCount; i++)
+			{
+				stats.QueueLatency[i].store(0, std::memory_order_relaxed);
+				stats.ExecutionTime[i].store(0, std::memory_order_relaxed);
+			}
+		}
+	}
+#endif
+
+	// index of the calling thread in this pool, in [0, GetMaxThreadCount()), or -1 for threads outside it
+	// stays the same for the life of the thread, so it can pick a per-thread accumulator without locking
+	int CurrentWorkerIndex()
+	{
+		Worker* worker = GetLocalWorker();
+		return worker ? (int)worker->Index : -1;
+	}
+
+	// scratch arena of the calling thread, released when the job or Iterate chunk running on it returns
+	// look it up once per job or chunk and keep the reference, threads outside a pool get one of their own
+	static ScratchArena& GetScratchArena()
+	{
+		return CurrentWorker ? CurrentWorker->Scratch : GetExternalScratch();
+	}
+
+	// name the job running on the calling thread in the trace, label must outlive the pool
+	// does nothing unless KTHREADPOOL_TRACE is defined, so labels can stay in the code
+	static void SetTraceLabel(const char* label)
+	{
+#ifdef KTHREADPOOL_TRACE
+		CurrentTraceLabel = label;
+#else
+		(void)label;
+#endif
+	}
+
+#ifdef KTHREADPOOL_TRACE
+
+	// write the events every thread still holds to path as Chrome trace JSON, which Perfetto and chrome://tracing open
+	// best called while the pool is idle, events recorded during the dump may be left out
+	// returns false if the file couldn't be written
+	bool DumpTrace(const char* path)
+	{
+		FILE* file = std::fopen(path, "w");
+		if (!file) return false;
+
+		std::fprintf(file, "{\"traceEvents\":[\n");
+		bool bFirst = true;
+
+		const auto writeThread = [&](TraceBuffer& buffer, size_t threadId, const char* threadName) -> void
+		{
+			std::fprintf(file, "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%zu,\"args\":{\"name\":\"%s\"}}", 
+				bFirst ? "" : ",\n", threadId, threadName);
+			bFirst = false;
+
+			const uint64_t count = buffer.Count.load(std::memory_order_acquire);
+			const uint64_t first = count > buffer.Capacity ? count - buffer.Capacity : 0;
+			std::vector<TraceEvent> events;
+			for (uint64_t i = first; i < count; i++)
+				events.push_back(buffer.Events[i % buffer.Capacity]);
+
+			// anything the owner wrapped around to while we were copying is torn, drop it
+			const uint64_t countAfter = buffer.Count.load(std::memory_order_acquire);
+			const uint64_t firstValid = countAfter > buffer.Capacity ? countAfter - buffer.Capacity : 0;
+
+			for (uint64_t i = first; i < count; i++)
+			{
+				if (i < firstValid) continue;
+
+				const TraceEvent& event = events[i - first];
+				std::fprintf(file, ",\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%zu,\"ts\":%.3f,\"dur\":%.3f", 
+					EscapeTraceLabel(event).c_str(), threadId, event.Start * 1e-3, (event.End - event.Start) * 1e-3);
+
+				if (event.Type == ETraceEvent::Chunk)
+					std::fprintf(file, ",\"args\":{\"first\":%zu,\"last\":%zu}", event.First, event.Last);
+				else if (event.Type == ETraceEvent::Section)
+					std::fprintf(file, ",\"args\":{\"first\":%zu,\"last\":%zu,\"weight\":%g}", event.First, event.Last, event.Weight);
+
+				std::fprintf(file, "}");
+			}
+		};
+
+		for (size_t i = 0; i < Workers.size(); i++)
+			writeThread(Workers[i]->Trace, i, ("Worker " + std::to_string(i)).c_str());
+
+		{
+			std::lock_guard<std::mutex> lock(ExternalTraceMutex);
+			writeThread(ExternalTrace, Workers.size(), "Other threads");
+		}
+
+		std::fprintf(file, "\n]}\n");
+		return std::fclose(file) == 0;
+	}
+
+	// drop every recorded event, only safe while the pool is idle
+	void ClearTrace()
+	{
+		for (const std::unique_ptr<Worker>& worker : Workers)
+			worker->Trace.Count.store(0, std::memory_order_relaxed);
+
+		std::lock_guard<std::mutex> lock(ExternalTraceMutex);
+		ExternalTrace.Count.store(0, std::memory_order_relaxed);
+	}
+#endif
+
+	// number of jobs waiting to be picked up, approximate while the pool is running
+	size_t GetPendingJobCount()
+	{
+		size_t count = 0;
+		for (const std::atomic<size_t>& laneSize : PendingJobsSize)
+			count += laneSize.load(std::memory_order_relaxed);
+
+		if (BoundedLanes)
+		{
+			for (size_t lane = 0; lane < (size_t)EJobPriority::Count; lane++)
+				count += BoundedLanes[lane].Size();
+		}
+
+		for (const std::unique_ptr<Worker>& worker : Workers)
+			count += worker->LocalJobs.Size();
+
+		return count;
+	}
+
+	// drops every job added with AddFunctionToPool, Submit and the like that hasn't started yet
+	// dropped jobs are destroyed without running, their futures become ready and cancelled and so do their continuations
+	// jobs the pool queued for itself, like Iterate runners, graph tasks and resumed coroutines, are queued again
+	//    since something is waiting on them
+	// returns how many jobs were dropped, a job that a thread is taking at the same moment may still run
+	size_t ClearPendingJobs()
+	{
+		std::vector<ThreadJobBase*> jobs;
+
+		{
+			std::lock_guard<std::mutex> lock(QueueMutex);
+			for (size_t lane = 0; lane < (size_t)EJobPriority::Count; lane++)
+			{
+				jobs.insert(jobs.end(), PendingJobs[lane].begin(), PendingJobs[lane].end());
+				PendingJobs[lane].clear();
+				PendingJobsSize[lane] = 0;
+			}
+		}
+
+		if (BoundedLanes)
+		{
+			for (size_t lane = 0; lane < (size_t)EJobPriority::Count; lane++)
+			{
+				while (ThreadJobBase* job = BoundedLanes[lane].Pop())
+					jobs.push_back(job);
+			}
+
+			// producers blocked on a full lane can go again
+			std::atomic_thread_fence(std::memory_order_seq_cst);
+			if (BlockedProducerCount.load(std::memory_order_relaxed) > 0)
+			{
+				SpaceEpoch++;
+				SpaceEpoch.notify_all();
+			}
+		}
+
+		// other threads' deques can only be emptied from the stealing end, which is safe while they run
+		const size_t workerCount = StartedWorkerCount.load();
+		for (size_t i = 0; i < workerCount; i++)
+		{
+			while (ThreadJobBase* job = Workers[i]->LocalJobs.Steal())
+				jobs.push_back(job);
+		}
+
+		size_t dropped = 0;
+		for (ThreadJobBase* job : jobs)
+		{
+			if (job->bDiscardable)
+			{
+				DiscardJob(job);
+				dropped++;
+			}
+			else
+			{
+				PostJob(job);
+			}
+		}
+
+		return dropped;
+	}
+
+	// blocks the calling thread until all pending and active jobs are finished
+	// called from one of the pool's own jobs it waits for every other job instead, running them on this thread meanwhile
+	// throws a JobError if any job without a future threw since the last wait, after every job has finished
+	void WaitForFinish()
+	{
+		if (Worker* worker = GetLocalWorker())
+		{
+			HelpForFinish<std::chrono::steady_clock, std::chrono::steady_clock::duration>(worker, nullptr);
+		}
+		else if (!SpinForFinish())
+		{
+			std::unique_lock<std::mutex> lock(FinishMutex);
+			FinishWaiterCount++;
+			FinishCondition.wait(lock, [this] { return GetUnfinishedJobCount() == 0; });
+			FinishWaiterCount--;
+		}
+
+		if (JobErrors.HasErrors()) JobErrors.Rethrow();
+	}
+
+	// same as WaitForFinish but gives up after timeout, returns true if all jobs finished
+	template <typename Rep, typename Period>
+	bool WaitForFinishFor(const std::chrono::duration<Rep, Period>& timeout)
+	{
+		return WaitForFinishUntil(std::chrono::steady_clock::now() + timeout);
+	}
+
+	// same as WaitForFinish but gives up at deadline, returns true if all jobs finished
+	// exceptions are only thrown when all jobs finished in time
+	template <typename Clock, typename Duration>
+	bool WaitForFinishUntil(const std::chrono::time_point<Clock, Duration>& deadline)
+	{
+		bool finished;
+		if (Worker* worker = GetLocalWorker())
+		{
+			finished = HelpForFinish(worker, &deadline);
+		}
+		else if (SpinForFinish())
+		{
+			finished = true;
+		}
+		else
+		{
+			std::unique_lock<std::mutex> lock(FinishMutex);
+			FinishWaiterCount++;
+			finished = FinishCondition.wait_until(lock, deadline, [this] { return GetUnfinishedJobCount() == 0; });
+			FinishWaiterCount--;
+		}
+
+		if (finished && JobErrors.HasErrors()) JobErrors.Rethrow();
+		return finished;
+	}
+
+	// runs every task in graph, each one as soon as all of its dependencies have finished
+	// blocks until the whole graph is done, a pool thread calling this keeps running other jobs while it waits
+	void RunGraph(TaskGraph& graph)
+	{
+		assert(graph.IsAcyclic());
+
+		if (graph.Tasks.empty()) return;
+
+		GraphRun run { &graph, (uint32_t)graph.Tasks.size() };
+		for (TaskGraph::Task& task : graph.Tasks)
+		{
+			task.Remaining.store(task.DependencyCount, std::memory_order_relaxed);
+			task.bSkip.store(false, std::memory_order_relaxed);
+		}
+
+		for (size_t i = 0; i < graph.Tasks.size(); i++)
+		{
+			if (graph.Tasks[i].DependencyCount == 0)
+				PostGraphTask(run, i);
+		}
+
+		WaitForLatch(run.Done);
+
+		if (run.Errors.HasErrors()) run.Errors.Rethrow();
+	}
+
+	// number of threads in the pool, threads that are retiring aren't counted
+	int GetThreadCount() const { return ThreadCount.load(std::memory_order_relaxed); }
+
+	// most threads the pool can grow to
+	int GetMaxThreadCount() const { return (int)Workers.size(); }
+
+	// shared pool used by the static Iterate functions, created with DefaultThreadCount threads on first use
+	static KThreadPool& GetDefaultPool()
+	{
+		static KThreadPool pool(DefaultThreadCount);
+		return pool;
+	}
+
+	// pool the calling thread belongs to, null when not called from a pool job
+	static KThreadPool* GetCurrentPool()
+	{
+		return CurrentWorker ? CurrentWorker->Pool : nullptr;
+	}
+
+	// iterate over data using this pool's threads, blocks until every element has been visited
+	// the calling thread runs part of the loop itself instead of sitting idle
+	template <typename Functor, typename T, typename... TArgs>
+	void ParallelFor(Functor func, std::vector<T>& data, TArgs&&... args)
+	{
+		RunIterate(func, IterOptions(), GetThreadCount(), data.data(), data.size(), args...);
+	}
+
+	template <typename Functor, typename T, typename... TArgs>
+	void ParallelFor(Functor func, T* data, size_t elementCount, TArgs&&... args)
+	{
+		RunIterate(func, IterOptions(), GetThreadCount(), data, elementCount, args...);
+	}
+
+	template <typename Functor, typename T, typename... TArgs>
+	void ParallelFor(Functor func, const IterOptions& options, std::vector<T>& data, TArgs&&... args)
+	{
+		RunIterate(func, options, GetThreadCount(), data.data(), data.size(), args...);
+	}
+
+	template <typename Functor, typename T, typename... TArgs>
+	void ParallelFor(Functor func, const IterOptions& options, T* data, size_t elementCount, TArgs&&... args)
+	{
+		RunIterate(func, options, GetThreadCount(), data, elementCount, args...);
+	}
+
+	template <typename Functor, typename WeightFunctor, typename T, typename... TArgs>
+	void ParallelForWeighted(Functor func, WeightFunctor weightFunc, std::vector<T>& data, TArgs&&... args)
+	{
+		RunIterateWeighted(func, weightFunc, WeightedOptions(), GetThreadCount(), data.data(), data.size(), args...);
+	}
+
+	template <typename Functor, typename WeightFunctor, typename T, typename... TArgs>
+	void ParallelForWeighted(Functor func, WeightFunctor weightFunc, T* data, size_t elementCount, TArgs&&... args)
+	{
+		RunIterateWeighted(func, weightFunc, WeightedOptions(), GetThreadCount(), data, elementCount, args...);
+	}
+
+	template <typename Functor, typename WeightFunctor, typename T, typename... TArgs>
+	void ParallelForWeighted(Functor func, WeightFunctor weightFunc, const WeightedOptions& options, std::vector<T>& data, TArgs&&... args)
+	{
+		RunIterateWeighted(func, weightFunc, options, GetThreadCount(), data.data(), data.size(), args...);
+	}
+
+	template <typename Functor, typename WeightFunctor, typename T, typename... TArgs>
+	void ParallelForWeighted(Functor func, WeightFunctor weightFunc, const WeightedOptions& options, T* data, size_t elementCount, TArgs&&... args)
+	{
+		RunIterateWeighted(func, weightFunc, options, GetThreadCount(), data, elementCount, args...);
+	}
+
+	// same as above with weights that were computed ahead of time, one per element
+	// weights must be passed as a std::span so they aren't taken for a weight function
+	template <typename Functor, typename T, typename... TArgs>
+	void ParallelForWeighted(Functor func, std::span<const double> weights, std::vector<T>& data, TArgs&&... args)
+	{
+		RunIterateWeighted(func, weights, WeightedOptions(), GetThreadCount(), data.data(), data.size(), args...);
+	}
+
+	template <typename Functor, typename T, typename... TArgs>
+	void ParallelForWeighted(Functor func, std::span<const double> weights, T* data, size_t elementCount, TArgs&&... args)
+	{
+		RunIterateWeighted(func, weights, WeightedOptions(), GetThreadCount(), data, elementCount, args...);
+	}
+
+	template <typename Functor, typename T, typename... TArgs>
+	void ParallelForWeighted(Functor func, std::span<const double> weights, const WeightedOptions& options, std::vector<T>& data, TArgs&&... args)
+	{
+		RunIterateWeighted(func, weights, options, GetThreadCount(), data.data(), data.size(), args...);
+	}
+
+	template <typename Functor, typename T, typename... TArgs>
+	void ParallelForWeighted(Functor func, std::span<const double> weights, const WeightedOptions& options, T* data, size_t elementCount, TArgs&&... args)
+	{
+		RunIterateWeighted(func, weights, options, GetThreadCount(), data, elementCount, args...);
+	}
+
+	// same as ParallelFor but returns right away, the loop runs on the pool threads while the caller carries on
+	// the future is ready once every element has been visited and can be waited on or chained with Then
+	// func and args are copied into the job, data has to stay alive until the loop is done
+	template <typename Functor, typename T, typename... TArgs>
+	Future<void> IterateAsync(Functor func, std::vector<T>& data, TArgs&&... args)
+	{
+		return IterateAsync(std::move(func), IterOptions(), data.data(), data.size(), std::forward<TArgs>(args)...);
+	}
+
+	template <typename Functor, typename T, typename... TArgs>
+	Future<void> IterateAsync(Functor func, T* data, size_t elementCount, TArgs&&... args)
+	{
+		return IterateAsync(std::move(func), IterOptions(), data, elementCount, std::forward<TArgs>(args)...);
+	}
+
+	template <typename Functor, typename T, typename... TArgs>
+	Future<void> IterateAsync(Functor func, const IterOptions& options, std::vector<T>& data, TArgs&&... args)
+	{
+		return IterateAsync(std::move(func), options, data.data(), data.size(), std::forward<TArgs>(args)...);
+	}
+
+	template <typename Functor, typename T, typename... TArgs>
+	Future<void> IterateAsync(Functor func, const IterOptions& options, T* data, size_t elementCount, TArgs&&... args)
+	{
+		// the loop itself runs as one job, the pool thread that takes it spreads it over the others like a nested ParallelFor
+		const auto loop = [this, options, data, elementCount](Functor& func, typename std::decay<TArgs>::type&... args) -> void
+		{
+			RunIterate(func, options, GetThreadCount(), data, elementCount, args...);
+		};
+
+		return Submit(loop, std::move(func), std::forward<TArgs>(args)...);
+	}
+
+	// same as ParallelForWeighted but returns right away, see IterateAsync
+	template <typename Functor, typename WeightFunctor, typename T, typename... TArgs>
+	Future<void> IterateWeightedAsync(Functor func, WeightFunctor weightFunc, std::vector<T>& data, TArgs&&... args)
+	{
+		return IterateWeightedAsync(std::move(func), std::move(weightFunc), WeightedOptions(), data.data(), data.size(), std::forward<TArgs>(args)...);
+	}
+
+	template <typename Functor, typename WeightFunctor, typename T, typename... TArgs>
+	Future<void> IterateWeightedAsync(Functor func, WeightFunctor weightFunc, T* data, size_t elementCount, TArgs&&... args)
+	{
+		return IterateWeightedAsync(std::move(func), std::move(weightFunc), WeightedOptions(), data, elementCount, std::forward<TArgs>(args)...);
+	}
+
+	template <typename Functor, typename WeightFunctor, typename T, typename... TArgs>
+	Future<void> IterateWeightedAsync(Functor func, WeightFunctor weightFunc, const WeightedOptions& options, std::vector<T>& data, TArgs&&... args)
+	{
+		return IterateWeightedAsync(std::move(func), std::move(weightFunc), options, data.data(), data.size(), std::forward<TArgs>(args)...);
+	}
+
+	// a WeightProfile in options is updated when the loop finishes, it can't be shared with another loop still running
+	template <typename Functor, typename WeightFunctor, typename T, typename... TArgs>
+	Future<void> IterateWeightedAsync(Functor func, WeightFunctor weightFunc, const WeightedOptions& options, T* data, size_t elementCount, TArgs&&... args)
+	{
+		const auto loop = [this, options, data, elementCount](Functor& func, WeightFunctor& weightFunc, typename std::decay<TArgs>::type&... args) -> void
+		{
+			RunIterateWeighted(func, weightFunc, options, GetThreadCount(), data, elementCount, args...);
+		};
+
+		return Submit(loop, std::move(func), std::move(weightFunc), std::forward<TArgs>(args)...);
+	}
+
+	// combine every element into one value, combine must be associative and commutative
+	// each thread accumulates into its own slot and the slots are combined pairwise at the end
+	// elements are converted to R, a container of pointers has the pointed to objects combined
+	template <typename T, typename R, typename CombineFunctor>
+	R Reduce(const std::vector<T>& data, R init, CombineFunctor combine, const IterOptions& options = IterOptions())
+	{
+		return Reduce(data.data(), data.size(), std::move(init), combine, options);
+	}
+
+	template <typename T, typename R, typename CombineFunctor>
+	R Reduce(T* data, size_t elementCount, R init, CombineFunctor combine, const IterOptions& options = IterOptions())
+	{
+		const auto identity = [](const auto* obj) -> R { return *obj; };
+		return TransformReduce(data, elementCount, std::move(init), combine, identity, options);
+	}
+
+	// same as Reduce but each element is first passed through transform, which can take any of the Iterate signatures
+	template <typename T, typename R, typename CombineFunctor, typename TransformFunctor>
+	R TransformReduce(std::vector<T>& data, R init, CombineFunctor combine, TransformFunctor transform, const IterOptions& options = IterOptions())
+	{
+		return TransformReduce(data.data(), data.size(), std::move(init), combine, transform, options);
+	}
+
+	// read only version, transform is passed const elements
+	template <typename T, typename R, typename CombineFunctor, typename TransformFunctor>
+	R TransformReduce(const std::vector<T>& data, R init, CombineFunctor combine, TransformFunctor transform, const IterOptions& options = IterOptions())
+	{
+		return TransformReduce(data.data(), data.size(), std::move(init), combine, transform, options);
+	}
+
+	template <typename T, typename R, typename CombineFunctor, typename TransformFunctor>
+	R TransformReduce(T* data, size_t elementCount, R init, CombineFunctor combine, TransformFunctor transform, const IterOptions& options = IterOptions())
+	{
+		if (elementCount == 0) return init;
+
+		size_t runnerCount = GetThreadCount();
+		if (runnerCount > elementCount) runnerCount = elementCount;
+
+		IterClaim claim(elementCount, runnerCount, options);
+
+		// padded so threads accumulating side by side don't share a cache line
+		struct alignas(CacheLineSize) Partial
+		{
+			std::optional<R> Value;
+		};
+
+		std::vector<Partial> partials(claim.RunnerCount);
+		std::atomic<size_t> nextPartial { 0 };
+
+		const auto runner = [&]() -> void
+		{
+			Partial& partial = partials[nextPartial.fetch_add(1, std::memory_order_relaxed)];
+
+			size_t start, end;
+			while (claim.Next(start, end))
+			{
+				// accumulate the range locally, then fold it into this thread's slot
+				R value = IterCallback(transform, data, start);
+				for (size_t i = start + 1; i < end; i++)
+					value = combine(std::move(value), IterCallback(transform, data, i));
+
+				if (partial.Value)
+					partial.Value = combine(std::move(*partial.Value), std::move(value));
+				else
+					partial.Value.emplace(std::move(value));
+			}
+		};
+
+		RunOnPool(claim.RunnerCount, runner);
+
+		for (size_t stride = 1; stride < partials.size(); stride *= 2)
+		{
+			for (size_t i = 0; i + stride < partials.size(); i += stride * 2)
+			{
+				std::optional<R>& left = partials[i].Value;
+				std::optional<R>& right = partials[i + stride].Value;
+
+				if (left && right)
+					left = combine(std::move(*left), std::move(*right));
+				else if (right)
+					left = std::move(right);
+			}
+		}
+
+		if (partials[0].Value)
+			return combine(std::move(init), std::move(*partials[0].Value));
+
+		return init;
+	}
+
+	// writes the running total of input to output, output[i] = input[0] op ... op input[i]
+	// op must be associative, input and output may be the same array
+	template <typename T, typename OpFunctor>
+	void InclusiveScan(const T* input, size_t count, T* output, OpFunctor op)
+	{
+		RunScan(input, count, output, op, (const T*)nullptr);
+	}
+
+	template <typename T, typename OpFunctor>
+	void InclusiveScan(std::vector<T>& data, OpFunctor op)
+	{
+		RunScan(data.data(), data.size(), data.data(), op, (const T*)nullptr);
+	}
+
+	// same as InclusiveScan but output[i] does not include input[i], output[0] is init
+	template <typename T, typename OpFunctor>
+	void ExclusiveScan(const T* input, size_t count, T* output, T init, OpFunctor op)
+	{
+		RunScan(input, count, output, op, &init);
+	}
+
+	template <typename T, typename OpFunctor>
+	void ExclusiveScan(std::vector<T>& data, T init, OpFunctor op)
+	{
+		RunScan(data.data(), data.size(), data.data(), op, &init);
+	}
+
+	// parallel merge sort, T must be default constructible and movable
+	template <typename T, typename CompareFunctor = std::less<T>>
+	void Sort(T* data, size_t count, CompareFunctor comp = CompareFunctor())
+	{
+		RunMergeSort(data, count, comp, false);
+	}
+
+	template <typename T, typename CompareFunctor = std::less<T>>
+	void Sort(std::vector<T>& data, CompareFunctor comp = CompareFunctor())
+	{
+		RunMergeSort(data.data(), data.size(), comp, false);
+	}
+
+	// same as Sort but equal elements keep their order
+	template <typename T, typename CompareFunctor = std::less<T>>
+	void StableSort(T* data, size_t count, CompareFunctor comp = CompareFunctor())
+	{
+		RunMergeSort(data, count, comp, true);
+	}
+
+	template <typename T, typename CompareFunctor = std::less<T>>
+	void StableSort(std::vector<T>& data, CompareFunctor comp = CompareFunctor())
+	{
+		RunMergeSort(data.data(), data.size(), comp, true);
+	}
+
+	// moves the elements pred is true for to the front, keeping the order within both groups
+	// returns the number of elements pred was true for, T must be default constructible and movable
+	template <typename T, typename PredicateFunctor>
+	size_t StablePartition(T* data, size_t count, PredicateFunctor pred)
+	{
+		if (count == 0) return 0;
+
+		std::vector<T> buffer(count);
+		const size_t selected = RunPartitionCopy<true>(data, count, pred, buffer.data(), true);
+
+		RunBlocks(count, GetBlockCount(count), [&](size_t, size_t start, size_t end) -> void
+		{
+			std::move(buffer.data() + start, buffer.data() + end, data + start);
+		});
+
+		return selected;
+	}
+
+	template <typename T, typename PredicateFunctor>
+	size_t StablePartition(std::vector<T>& data, PredicateFunctor pred)
+	{
+		return StablePartition(data.data(), data.size(), pred);
+	}
+
+	// copies the elements pred is true for to output in order, output needs room for count elements
+	// returns the number of elements copied
+	template <typename T, typename PredicateFunctor>
+	size_t CopyIf(const T* input, size_t count, T* output, PredicateFunctor pred)
+	{
+		if (count == 0) return 0;
+		return RunPartitionCopy<false>(const_cast<T*>(input), count, pred, output, false);
+	}
+
+	// copies the elements pred is true for into a new vector, in order
+	template <typename T, typename PredicateFunctor>
+	std::vector<T> CopyIf(const std::vector<T>& data, PredicateFunctor pred)
+	{
+		std::vector<T> result(data.size());
+		result.resize(CopyIf(data.data(), data.size(), result.data(), pred));
+		return result;
+	}
+
+	// index of the first element pred is true for, or count if there is none
+	// chunks are claimed from the front and no thread starts a chunk past a match that was already found,
+	//    so a match early in the array only costs the chunks before it
+	// options.GrainSize and options.Cancel are used, chunks are always claimed dynamically
+	template <typename T, typename PredicateFunctor>
+	size_t FindFirst(const T* data, size_t count, PredicateFunctor pred, const IterOptions& options = IterOptions())
+	{
+		return RunFind(data, count, pred, options, true);
+	}
+
+	template <typename T, typename PredicateFunctor>
+	size_t FindFirst(const std::vector<T>& data, PredicateFunctor pred, const IterOptions& options = IterOptions())
+	{
+		return RunFind(data.data(), data.size(), pred, options, true);
+	}
+
+	// whether pred is true for any element, every thread stops before its next chunk once one finds a match
+	template <typename T, typename PredicateFunctor>
+	bool AnyOf(const T* data, size_t count, PredicateFunctor pred, const IterOptions& options = IterOptions())
+	{
+		return RunFind(data, count, pred, options, false) != count;
+	}
+
+	template <typename T, typename PredicateFunctor>
+	bool AnyOf(const std::vector<T>& data, PredicateFunctor pred, const IterOptions& options = IterOptions())
+	{
+		return AnyOf(data.data(), data.size(), pred, options);
+	}
+
+	// whether pred is true for every element, stops at the first element it's false for
+	template <typename T, typename PredicateFunctor>
+	bool AllOf(const T* data, size_t count, PredicateFunctor pred, const IterOptions& options = IterOptions())
+	{
+		const auto fails = [&pred](const T& value) -> bool { return !pred(value); };
+		return !AnyOf(data, count, fails, options);
+	}
+
+	template <typename T, typename PredicateFunctor>
+	bool AllOf(const std::vector<T>& data, PredicateFunctor pred, const IterOptions& options = IterOptions())
+	{
+		return AllOf(data.data(), data.size(), pred, options);
+	}
+
+	// static versions run on the default pool, poolSize limits how many of its threads are used
+	//    and is capped at its thread count, threads are never started just for one call
+	// called from inside a pool job they run on that job's pool instead, capped the same way,
+	//    so nested loops share the threads that are already running rather than starting more
+	template <typename Functor, typename T, typename... TArgs>
+	static void Iterate(Functor func, int poolSize, std::vector<T>& data, TArgs&&... args)
+	{
+		Iterate(func, IterOptions(), poolSize, data.data(), data.size(), std::forward<TArgs>(args)...);
+	}
+
+	template <typename Functor, typename T, typename... TArgs>
+	static void Iterate(Functor func, int poolSize, T* data, size_t elementCount, TArgs&&... args)
+	{
+		Iterate(func, IterOptions(), poolSize, data, elementCount, std::forward<TArgs>(args)...);
+	}
+
+	template <typename Functor, typename T, typename... TArgs>
+	static void Iterate(Functor func, const IterOptions& options, int poolSize, std::vector<T>& data, TArgs&&... args)
+	{
+		Iterate(func, options, poolSize, data.data(), data.size(), std::forward<TArgs>(args)...);
+	}
+
+	template <typename Functor, typename T, typename... TArgs>
+	static void Iterate(Functor func, const IterOptions& options, int poolSize, T* data, size_t elementCount, TArgs&&... args)
+	{
+		KThreadPool* currentPool = GetCurrentPool();
+		KThreadPool& pool = currentPool ? *currentPool : GetDefaultPool();
+		pool.RunIterate(func, options, pool.GetRunnerCount(poolSize), data, elementCount, args...);
+	}
+
+	template <typename Functor, typename WeightFunctor, typename T, typename... TArgs>
+	static void IterateWeighted(Functor func, WeightFunctor weightFunc, int poolSize, std::vector<T>& data, TArgs&&... args)
+	{
+		IterateWeighted(func, weightFunc, WeightedOptions(), poolSize, data.data(), data.size(), std::forward<TArgs>(args)...);
+	}
+
+	template <typename Functor, typename WeightFunctor, typename T, typename... TArgs>
+	static void IterateWeighted(Functor func, WeightFunctor weightFunc, int poolSize, T* data, size_t elementCount, TArgs&&... args)
+	{
+		IterateWeighted(func, weightFunc, WeightedOptions(), poolSize, data, elementCount, std::forward<TArgs>(args)...);
+	}
+
+	template <typename Functor, typename WeightFunctor, typename T, typename... TArgs>
+	static void IterateWeighted(Functor func, WeightFunctor weightFunc, const WeightedOptions& options, int poolSize, std::vector<T>& data, TArgs&&... args)
+	{
+		IterateWeighted(func, weightFunc, options, poolSize, data.data(), data.size(), std::forward<TArgs>(args)...);
+	}
+
+	template <typename Functor, typename WeightFunctor, typename T, typename... TArgs>
+	static void IterateWeighted(Functor func, WeightFunctor weightFunc, const WeightedOptions& options, int poolSize, T* data, size_t elementCount, TArgs&&... args)
+	{
+		KThreadPool* currentPool = GetCurrentPool();
+		KThreadPool& pool = currentPool ? *currentPool : GetDefaultPool();
+		pool.RunIterateWeighted(func, weightFunc, options, pool.GetRunnerCount(poolSize), data, elementCount, args...);
+	}
+
+private: 
+
+	// blocks until the latch reaches zero
+	// a thread from this pool runs jobs while it waits, since the jobs it is waiting on may be sitting in its own deque
+	void WaitForLatch(JobLatch& latch)
+	{
+		const bool bHelp = GetLocalWorker() != nullptr;
+
+		for (int i = 0; i < IdleSpinCount; i++)
+		{
+			if (latch.IsDone()) return;
+
+			if (bHelp && TakeNewJob())
+				i = 0;
+			else
+				CpuRelax();
+		}
+
+		uint32_t remaining;
+		while ((remaining = latch.Remaining.load(std::memory_order_acquire)) != 0)
+			latch.Remaining.wait(remaining);
+	}
+
+	// state of one RunGraph call, lives on the caller's stack
+	struct GraphRun
+	{
+		TaskGraph* Graph;
+
+		// counts down once per finished task
+		JobLatch Done;
+
+		ErrorCollector Errors;
+
+		GraphRun(TaskGraph* graph, uint32_t taskCount) : Graph(graph), Done(taskCount) {}
+	};
+
+	// runs one graph task, then posts every successor that was only waiting on it
+	struct GraphJob : public ThreadJobBase
+	{
+		KThreadPool* Pool;
+		GraphRun* Run;
+		size_t Index;
+
+		GraphJob(KThreadPool* pool, GraphRun* run, size_t index) : Pool(pool), Run(run), Index(index) {}
+
+		virtual void Execute() override
+		{
+			TaskGraph::Task& task = Run->Graph->Tasks[Index];
+
+			// a task that throws still finishes, but everything after it is skipped, fed what it never produced
+			bool bSkip = task.bSkip.load(std::memory_order_relaxed);
+			if (!bSkip)
+			{
+				try
+				{
+					task.Function->Invoke();
+				}
+				catch (...)
+				{
+					Run->Errors.Capture(std::current_exception());
+					bSkip = true;
+				}
+			}
+
+			// successors are posted before counting down so the run can't finish while they are still unposted
+			// posting from a pool thread puts them on its own deque, where they are likely to be the next job it takes
+			for (size_t successor : task.Successors)
+			{
+				if (bSkip) Run->Graph->Tasks[successor].bSkip.store(true, std::memory_order_relaxed);
+
+				if (Run->Graph->Tasks[successor].Remaining.fetch_sub(1, std::memory_order_acq_rel) == 1)
+					Pool->PostGraphTask(*Run, successor);
+			}
+
+			Run->Done.CountDown();
+		}
+	};
+
+	void PostGraphTask(GraphRun& run, size_t index)
+	{
+		GraphJob* job = MakeJob<GraphJob>(this, &run, index);
+		job->Priority = run.Graph->Tasks[index].Priority;
+		AddJobToPool(job);
+	}
+
+	// CPUs this process may run on, read once
+	static const std::vector<CpuInfo>& GetCpuTopology()
+	{
+		static const std::vector<CpuInfo> topology = ReadCpuTopology();
+		return topology;
+	}
+
+	static std::vector<CpuInfo> ReadCpuTopology()
+	{
+		std::vector<CpuInfo> cpus;
+
+#if defined(__linux__)
+		cpu_set_t set;
+		CPU_ZERO(&set);
+		if (sched_getaffinity(0, sizeof(set), &set) == 0)
+		{
+			for (int cpu = 0; cpu < CPU_SETSIZE; cpu++)
+			{
+				if (!CPU_ISSET(cpu, &set)) continue;
+
+				// core ids are only unique within a package
+				const std::string path = "/sys/devices/system/cpu/cpu" + std::to_string(cpu) + "/topology/";
+				const long long package = ReadSysValue(path + "physical_package_id", 0);
+				const long long core = ReadSysValue(path + "core_id", cpu);
+				cpus.push_back({ cpu, (int)(package * 65536 + core), 0 });
+			}
+
+			// nodes without any CPU we can use are skipped so node numbers stay dense
+			size_t nodeIndex = 0;
+			for (int node : ParseCpuList(ReadSysLine("/sys/devices/system/node/online")))
+			{
+				bool bUsed = false;
+				for (int cpu : ParseCpuList(ReadSysLine("/sys/devices/system/node/node" + std::to_string(node) + "/cpulist")))
+				{
+					for (CpuInfo& info : cpus)
+					{
+						if (info.Cpu != cpu) continue;
+
+						info.Node = nodeIndex;
+						bUsed = true;
+					}
+				}
+
+				if (bUsed) nodeIndex++;
+			}
+		}
+#endif
+
+		if (cpus.empty())
+		{
+			const int count = GetCpuCoreCount() > 0 ? GetCpuCoreCount() : 1;
+			for (int cpu = 0; cpu < count; cpu++)
+				cpus.push_back({ cpu, cpu, 0 });
+		}
+
+		return cpus;
+	}
+
+	// CPUs worth of time a cgroup quota allows this process, rounded up, 0 when there is no quota
+	static int GetCpuQuota()
+	{
+#if defined(__linux__)
+		// cgroup v2 has "quota period" or "max period" in one file, v1 has one file each
+		long long quota = -1;
+		long long period = 0;
+
+		std::ifstream file("/sys/fs/cgroup/cpu.max");
+		std::string max;
+		if (file >> max >> period)
+		{
+			if (max != "max")
+				quota = std::strtoll(max.c_str(), nullptr, 10);
+		}
+		else
+		{
+			quota = ReadSysValue("/sys/fs/cgroup/cpu/cpu.cfs_quota_us", -1);
+			period = ReadSysValue("/sys/fs/cgroup/cpu/cpu.cfs_period_us", 0);
+		}
+
+		if (quota > 0 && period > 0)
+			return (int)((quota + period - 1) / period);
+#endif
+
+		return 0;
+	}
+
+#if defined(__linux__)
+	static std::string ReadSysLine(const std::string& path)
+	{
+		std::ifstream file(path);
+		std::string line;
+		std::getline(file, line);
+		return line;
+	}
+
+	static long long ReadSysValue(const std::string& path, long long fallback)
+	{
+		std::ifstream file(path);
+		long long value;
+		return file >> value ? value : fallback;
+	}
+
+	// parses the kernel's list format, "0-3,8,10-11"
+	static std::vector<int> ParseCpuList(const std::string& list)
+	{
+		std::vector<int> cpus;
+
+		const char* c = list.c_str();
+		while (*c)
+		{
+			char* end;
+			const long first = std::strtol(c, &end, 10);
+			if (end == c) break;
+
+			long last = first;
+			c = end;
+			if (*c == '-')
+			{
+				last = std::strtol(c + 1, &end, 10);
+				c = end;
+			}
+
+			for (long cpu = first; cpu <= last; cpu++)
+				cpus.push_back((int)cpu);
+
+			if (*c == ',') c++;
+		}
+
+		return cpus;
+	}
+#endif
+
+	// restrict the calling thread to cpus, does nothing if cpus is empty or on platforms without placement
+	static void SetThreadAffinity(const std::vector<int>& cpus)
+	{
+#if defined(__linux__)
+		if (cpus.empty()) return;
+
+		cpu_set_t set;
+		CPU_ZERO(&set);
+		for (int cpu : cpus)
+			CPU_SET(cpu, &set);
+
+		// failing just leaves the thread where the OS put it
+		pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+#else
+		(void)cpus;
+#endif
+	}
+
+	// pick the CPUs and node for each worker
+	void PlaceWorkers(EAffinity affinity)
+	{
+		const std::vector<CpuInfo>& topology = GetCpuTopology();
+
+		size_t nodeCount = 0;
+		for (const CpuInfo& cpu : topology)
+			nodeCount = std::max(nodeCount, cpu.Node + 1);
+
+		if (affinity == EAffinity::Node)
+		{
+			for (size_t i = 0; i < Workers.size(); i++)
+			{
+				Worker& worker = *Workers[i];
+				worker.Node = i % nodeCount;
+
+				for (const CpuInfo& cpu : topology)
+				{
+					if (cpu.Node == worker.Node)
+						worker.Cpus.push_back(cpu.Cpu);
+				}
+			}
+		}
+		else
+		{
+			// each node's CPUs with one per physical core first and their siblings after,
+			//    then taken from the nodes in turn so threads spread over every node and core before doubling up
+			std::vector<std::vector<const CpuInfo*>> nodeOrder(nodeCount);
+			for (int bSiblings = 0; bSiblings < 2; bSiblings++)
+			{
+				std::vector<int> seenCores;
+				for (const CpuInfo& cpu : topology)
+				{
+					const bool bFirstOnCore = std::find(seenCores.begin(), seenCores.end(), cpu.Core) == seenCores.end();
+					if (bFirstOnCore) seenCores.push_back(cpu.Core);
+
+					if (bFirstOnCore != (bSiblings == 1))
+						nodeOrder[cpu.Node].push_back(&cpu);
+				}
+			}
+
+			std::vector<const CpuInfo*> order;
+			for (size_t i = 0; order.size() < topology.size(); i++)
+			{
+				for (std::vector<const CpuInfo*>& node : nodeOrder)
+				{
+					if (i < node.size())
+						order.push_back(node[i]);
+				}
+			}
+
+			for (size_t i = 0; i < Workers.size(); i++)
+			{
+				const CpuInfo& cpu = *order[i % order.size()];
+				Workers[i]->Node = cpu.Node;
+				Workers[i]->Cpus.push_back(cpu.Cpu);
+			}
+		}
+
+		// workers are handed out over the nodes in turn, so the first ones cover every node that gets a thread
+		NodeCount = std::min(nodeCount, Workers.size());
+	}
+
+	// number of threads a static Iterate with poolSize uses on this pool, 0 or anything larger than the pool uses all of it
+	int GetRunnerCount(int poolSize) const
+	{
+		return poolSize <= 0 || poolSize > GetThreadCount() ? GetThreadCount() : poolSize;
+	}
+
+	// runs job on the calling thread and runnerCount - 1 copies of it on the pool, returns when all of them are done
+	template <typename Job>
+	void RunOnPool(size_t runnerCount, Job& job)
+	{
+		// a runner that throws still counts down, the first exception is rethrown once all of them are done
+		JobLatch latch((uint32_t)runnerCount - 1);
+		ErrorCollector errors;
+		const auto runner = [&job, &latch, &errors]() -> void
+		{
+			try
+			{
+				job();
+			}
+			catch (...)
+			{
+				errors.Capture(std::current_exception());
+			}
+
+			latch.CountDown();
+		};
+
+		typedef ThreadJob<decltype(runner)> RunnerJob;
+
+		// posted in batches so a wide pool doesn't take the queue lock once per runner
+		ThreadJobBase* batch[64];
+		size_t batchCount = 0;
+		for (size_t i = 1; i < runnerCount; i++)
+		{
+			batch[batchCount++] = MakeJob<RunnerJob>(runner);
+			if (batchCount == std::size(batch) || i == runnerCount - 1)
+			{
+				AddJobsToPool(batch, batchCount);
+				batchCount = 0;
+			}
+		}
+
+		try
+		{
+			job();
+		}
+		catch (...)
+		{
+			errors.Capture(std::current_exception());
+		}
+
+		WaitForLatch(latch);
+		if (errors.HasErrors()) errors.Rethrow();
+	}
+
+	template <typename Functor, typename T, typename... TArgs>
+	void RunIterate(Functor& func, const IterOptions& options, int runnerCount, T* data, size_t elementCount, TArgs&... args)
+	{
+		if (elementCount == 0) return;
+
+		if (runnerCount <= 0) runnerCount = 1;
+		if ((size_t)runnerCount > elementCount) runnerCount = (int)elementCount;
+
+		IterClaim claim(elementCount, runnerCount, options);
+
+		// a chunk that throws is counted and stops there, the other chunks still run
+		ErrorCollector errors;
+
+		// each runner claims ranges until there are none left and iterates them in a tight loop
+		const auto runner = [&]() -> void
+		{
+			ScratchArena& scratch = GetScratchArena();
+			const ScratchArena::Mark scratchMark = scratch.GetMark();
+
+			size_t start, end;
+			while (claim.Next(start, end))
+			{
+#ifdef KTHREADPOOL_TRACE
+				TraceEvent event;
+				event.Type = ETraceEvent::Chunk;
+				event.First = start;
+				event.Last = end;
+				event.Start = ClockNanoseconds();
+#endif
+
+				try
+				{
+					IterChunk(func, data, start, end, args...);
+				}
+				catch (...)
+				{
+					errors.Capture(std::current_exception());
+				}
+
+				scratch.Rewind(scratchMark);
+
+#ifdef KTHREADPOOL_TRACE
+				event.End = ClockNanoseconds();
+				RecordTrace(event);
+#endif
+			}
+		};
+
+		RunOnPool(claim.RunnerCount, runner);
+		if (errors.HasErrors()) errors.Rethrow();
+	}
+
+	template <typename Functor, typename WeightFunctor, typename T, typename... TArgs>
+	void RunIterateWeighted(Functor& func, WeightFunctor& weightFunc, const WeightedOptions& options, int runnerCount, T* data, size_t elementCount, TArgs&... args)
+	{
+		typedef typename std::remove_pointer<T>::type type;
+		static_assert(std::is_invocable<WeightFunctor, type*>::value, "weight function must take a pointer to T as its only argument");
+		static_assert(std::is_same<double, decltype(weightFunc(std::declval<const type*>()))>::value, 
+			"weight function take a const pointer to object type and must return double");
+
+		const auto getWeight = [&weightFunc, data](size_t i) -> double
+		{
+			if constexpr (std::is_pointer<T>::value)
+				return weightFunc(data[i]);
+			else
+				return weightFunc(&data[i]);
+		};
+
+		RunWeightedSections(func, getWeight, options, runnerCount, data, elementCount, args...);
+	}
+
+	template <typename Functor, typename T, typename... TArgs>
+	void RunIterateWeighted(Functor& func, std::span<const double> weights, const WeightedOptions& options, int runnerCount, T* data, size_t elementCount, TArgs&... args)
+	{
+		assert(weights.size() >= elementCount && "need a weight for every element");
+
+		const auto getWeight = [weights](size_t i) -> double
+		{
+			return weights[i];
+		};
 
-	// number of currently running jobs in the pool
-	std::atomic<size_t> ActiveJobCount { 0 };
+		RunWeightedSections(func, getWeight, options, runnerCount, data, elementCount, args...);
+	}
 
-	// whether or not the pool is pending destroy
-	std::atomic<bool> bDestroyingPool { false };
+	template <typename Functor, typename WeightGetter, typename T, typename... TArgs>
+	void RunWeightedSections(Functor& func, const WeightGetter& getWeight, const WeightedOptions& options, int runnerCount, T* data, size_t elementCount, TArgs&... args)
+	{
+		if (elementCount == 0) return;
 
-	// functions waiting to be picked up by a thread
-	std::vector<ThreadJobBase*> PendingJobs;
+		if (runnerCount <= 0) runnerCount = 1;
+		if ((size_t)runnerCount > elementCount) runnerCount = (int)elementCount;
 
-	// mutex to allow multiple threads to read from PendingJobs
-	std::mutex QueueMutex;
+		WeightProfile* profile = options.Profile;
+		if (profile && profile->Factors.size() != elementCount)
+			profile->Factors.assign(elementCount, 1.0);
 
-public:
+		// running total of the weights, computed on the pool
+		std::vector<double> prefix(elementCount);
+		ComputeWeightPrefix(getWeight, profile, runnerCount, prefix);
 
-	// default number of threads to be used in a pool, leave at 0 to use the CPU core count
-	// setting this to ( GetCpuCoreCount() - 1 ) can be useful to prevent the user's computer from locking up during long tasks
-	inline static int DefaultThreadCount = 0;
+		const size_t sectionsPerThread = options.SectionsPerThread > 0 ? options.SectionsPerThread : 1;
+		std::vector<IterSection> sections;
+		SplitWeighted(prefix, runnerCount * sectionsPerThread, options.ChunkAlignment, sections);
 
-private:
+		std::vector<double> seconds(profile ? sections.size() : 0);
 
-	template <typename Functor, typename... TArgs>
-	struct ThreadJob : public ThreadJobBase
-	{
-		Functor Function;
-		std::tuple<TArgs...> Args;
-		bool bDeleteOnFinish = true;
+		// with threads placed on NUMA nodes each node gets its own contiguous run of sections,
+		//    so the same elements are visited from the same node every call and stay in that node's memory
+		// a runner works through its own node's sections first and then helps the other nodes
+		struct alignas(CacheLineSize) NodeSections
+		{
+			size_t Start = 0;
+			size_t End = 0;
+			std::atomic<size_t> Next { 0 };
+		};
 
-		ThreadJob(Functor func, TArgs... args) 
-			: Function(func)
+		const size_t nodeCount = NodeCount;
+		std::vector<NodeSections> nodes(nodeCount);
+		for (size_t node = 0; node < nodeCount; node++)
 		{
-			Args = std::make_tuple(args...);
+			nodes[node].Start = sections.size() * node / nodeCount;
+			nodes[node].End = sections.size() * (node + 1) / nodeCount;
+			nodes[node].Next = nodes[node].Start;
 		}
 
-		ThreadJob(bool deleteOnFinish, Functor func, TArgs... args) 
-			: bDeleteOnFinish(deleteOnFinish), Function(func)
-		{		
-			Args = std::make_tuple(args...);
-		}
+		// hand out the heaviest sections of each node first so the last ones to be claimed are small enough to even things out
+		std::vector<size_t> claimOrder(sections.size());
+		for (size_t i = 0; i < claimOrder.size(); i++)
+			claimOrder[i] = i;
 
-		virtual void Execute() override
+		for (const NodeSections& node : nodes)
 		{
-			std::apply(Function, Args);
-			if (bDeleteOnFinish) delete this;
+			std::sort(claimOrder.begin() + node.Start, claimOrder.begin() + node.End, [&sections](size_t a, size_t b) -> bool 
+			{ 
+				return sections[a].Weight > sections[b].Weight; 
+			});
 		}
-	};
-
-public:
-
-	KThreadPool() = default;
-	~KThreadPool()
-	{
-		bDestroyingPool = true; // allows threads to exit when they finish
-		for (std::thread& t : Threads) 
-			t.join();
-	}
 
-	// count - number of threads in the pool, set to 0 to use DefaultThreadCount	
-	// restTime - time threads wait between checking for new jobs to be posted,
-	//    non-zero values can be useful if the pool is expected to be idle a lot 	
-	KThreadPool(int count = 0, double restTime = 0)
-	{
-		if (count == 0)
-			count = DefaultThreadCount == 0 ? GetCpuCoreCount() : DefaultThreadCount;
+		// a section that throws is counted and stops there, the other sections still run
+		ErrorCollector errors;
 
-		if (count <= 0) 
-			count = 1;
+		// each runner takes the next unclaimed section until there are none left
+		const auto runner = [&]() -> void
+		{
+			Worker* worker = GetLocalWorker();
+			const size_t firstNode = worker ? worker->Node : 0;
 
-		Threads.reserve(count);
+			ScratchArena& scratch = GetScratchArena();
+			const ScratchArena::Mark scratchMark = scratch.GetMark();
 
-		// keeps threads alive while waiting for a new job to consume
-		const auto waitForJob = [](KThreadPool* pool, size_t threadIndex, double restTime) -> void
-		{
-			while (true)
+			for (size_t n = 0; n < nodeCount; n++)
 			{
-				bool tookNew = pool->TakeNewJob();
+				NodeSections& node = nodes[(firstNode + n) % nodeCount];
 
-				if (!tookNew)
+				size_t claimed;
+				while ((claimed = node.Next.fetch_add(1, std::memory_order_relaxed)) < node.End)
 				{
-					if (!pool->IsPendingDestroy())
+					if (options.Cancel && options.Cancel->IsCancelled()) return;
+
+					const size_t sectionIndex = claimOrder[claimed];
+					const IterSection& section = sections[sectionIndex];
+					const auto start = profile ? std::chrono::steady_clock::now() : std::chrono::steady_clock::time_point();
+
+#ifdef KTHREADPOOL_TRACE
+					TraceEvent event;
+					event.Type = ETraceEvent::Section;
+					event.First = section.Start;
+					event.Last = section.End;
+					event.Weight = section.Weight;
+					event.Start = ClockNanoseconds();
+#endif
+
+					try
 					{
-						if (restTime > 0)
-						{
-							std::this_thread::sleep_for(std::chrono::duration<double>(restTime));
-						}		
+						IterChunk(func, data, section.Start, section.End, args...);
 					}
-					else
+					catch (...)
 					{
-						return;
+						errors.Capture(std::current_exception());
 					}
+
+					scratch.Rewind(scratchMark);
+
+#ifdef KTHREADPOOL_TRACE
+					event.End = ClockNanoseconds();
+					RecordTrace(event);
+#endif
+
+					if (profile)
+						seconds[sectionIndex] = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
 				}
 			}
 		};
 
-		for (int i = 0; i < count; i++)
-		{
-			Threads.push_back(std::thread(waitForJob, this, i, restTime));
-		}
-	}
+		RunOnPool((size_t)runnerCount < sections.size() ? (size_t)runnerCount : sections.size(), runner);
 
-private:
+		if (errors.HasErrors()) errors.Rethrow();
 
-	void AddJobToPool(ThreadJobBase* job)
-	{
-		std::lock_guard<std::mutex> lock(QueueMutex);
-		PendingJobs.push_back(job);
+		// a cancelled loop didn't time every section
+		if (profile && !(options.Cancel && options.Cancel->IsCancelled())) 
+			profile->Update(sections, seconds);
 	}
 
-	// thread attempts to get the next job from the pool
-	bool TakeNewJob()
+	// blocked two pass scan, each block is totaled in parallel, the totals are scanned,
+	//    then each block is scanned again starting from the total of everything before it
+	// exclusive when init is set
+	template <typename T, typename OpFunctor>
+	void RunScan(const T* input, size_t count, T* output, OpFunctor& op, const T* init)
 	{
-		ThreadJobBase* job = nullptr;
+		if (count == 0) return;
+
+		const size_t blockCount = GetBlockCount(count);
 
+		// total of each block, then the total of everything before each block
+		std::vector<std::optional<T>> blockTotals(blockCount);
+
+		if (blockCount > 1)
 		{
-			std::lock_guard<std::mutex> lock(QueueMutex);
-			if (PendingJobs.size() > 0)
+			RunBlocks(count, blockCount, [&](size_t block, size_t start, size_t end) -> void
 			{
-				// use last index so we're not constantly shifting the entire array
-				// keep in mind, most recently queued will run first
-				job = PendingJobs[PendingJobs.size() - 1];
-				PendingJobs.erase(PendingJobs.begin() + (PendingJobs.size() - 1));
-				ActiveJobCount++;
-			}
+				T total = input[start];
+				for (size_t i = start + 1; i < end; i++)
+					total = op(std::move(total), input[i]);
+
+				blockTotals[block].emplace(std::move(total));
+			});
 		}
 
-		if (job)
+		std::optional<T> carry;
+		if (init) carry.emplace(*init);
+
+		for (std::optional<T>& blockTotal : blockTotals)
 		{
-			job->Execute();
-			ActiveJobCount--;
+			std::optional<T> total = std::move(blockTotal);
+			blockTotal = carry;
 
-			return true;
+			if (total) carry = carry ? op(std::move(*carry), std::move(*total)) : std::move(*total);
 		}
 
-		return false;
-	}
+		RunBlocks(count, blockCount, [&](size_t block, size_t start, size_t end) -> void
+		{
+			std::optional<T> running = blockTotals[block];
+			for (size_t i = start; i < end; i++)
+			{
+				// read before writing so the scan can run in place
+				T value = input[i];
 
-public:
+				if (init)
+				{
+					output[i] = *running;
+					running = op(std::move(*running), std::move(value));
+				}
+				else
+				{
+					running = running ? op(std::move(*running), std::move(value)) : std::move(value);
+					output[i] = *running;
+				}
+			}
+		});
+	}
 
-	// number of cores on the CPU
-	static int GetCpuCoreCount()
+	// fills prefix with the running total of every element's weight, times its profile factor if there is one
+	// each runner sums one block, then the block totals are offset into every block in a second pass
+	template <typename WeightGetter>
+	void ComputeWeightPrefix(const WeightGetter& getWeight, const WeightProfile* profile, int runnerCount, std::vector<double>& prefix)
 	{
-		return (int)std::thread::hardware_concurrency();
+		const size_t count = prefix.size();
+		const auto weightAt = [&](size_t i) -> double
+		{
+			return profile ? getWeight(i) * profile->Factors[i] : getWeight(i);
+		};
+
+		// not worth waking the pool for
+		if (runnerCount == 1 || count < 4096)
+		{
+			double total = 0;
+			for (size_t i = 0; i < count; i++)
+				prefix[i] = total += weightAt(i);
+
+			return;
+		}
+
+		const size_t blockCount = runnerCount;
+		std::vector<double> blockOffsets(blockCount);
+
+		RunBlocks(count, blockCount, [&](size_t block, size_t start, size_t end) -> void
+		{
+			double total = 0;
+			for (size_t i = start; i < end; i++)
+				prefix[i] = total += weightAt(i);
+
+			blockOffsets[block] = total;
+		});
+
+		double offset = 0;
+		for (double& blockOffset : blockOffsets)
+		{
+			const double total = blockOffset;
+			blockOffset = offset;
+			offset += total;
+		}
+
+		RunBlocks(count, blockCount, [&](size_t block, size_t start, size_t end) -> void
+		{
+			if (block == 0) return;
+
+			for (size_t i = start; i < end; i++)
+				prefix[i] += blockOffsets[block];
+		});
 	}
 
-	// add a function to the pool to be processed by the next available thread
-	template <typename Functor, typename... TArgs>
-	void AddFunctionToPool(Functor func, TArgs... args)
+	// split [0, count) into blockCount equal blocks and call func(block, start, end) for each one on the pool
+	template <typename Functor>
+	void RunBlocks(size_t count, size_t blockCount, const Functor& func)
 	{
-		AddJobToPool(new ThreadJob(func, std::forward<TArgs>(args)...));
-	}
+		std::atomic<size_t> nextBlock { 0 };
+		const auto runner = [&]() -> void
+		{
+			size_t block;
+			while ((block = nextBlock.fetch_add(1, std::memory_order_relaxed)) < blockCount)
+				func(block, count * block / blockCount, count * (block + 1) / blockCount);
+		};
 
-	bool IsPendingDestroy() { return bDestroyingPool; }
+		const size_t threadCount = GetThreadCount();
+		RunOnPool(blockCount < threadCount ? blockCount : threadCount, runner);
+	}
 
-	size_t GetPendingJobCount()
+	// number of blocks the algorithms split count elements into, one per thread unless the blocks would be tiny
+	size_t GetBlockCount(size_t count) const
 	{
-		std::lock_guard<std::mutex> lock(QueueMutex);
-		return PendingJobs.size();
+		const size_t minBlockSize = 2048;
+		const size_t threadCount = GetThreadCount();
+
+		size_t blockCount = count / minBlockSize;
+		if (blockCount > threadCount) blockCount = threadCount;
+
+		return blockCount > 0 ? blockCount : 1;
 	}
 
-	void WaitForFinish()
+	// sorts data with count / blockCount sized runs sorted in parallel and then merged pairwise
+	// every merge is split into independent pieces along its merge path so each round uses every thread
+	template <typename T, typename CompareFunctor>
+	void RunMergeSort(T* data, size_t count, CompareFunctor& comp, bool bStable)
 	{
-		while (GetPendingJobCount() > 0 || ActiveJobCount > 0) {}
+		const size_t blockCount = GetBlockCount(count);
+		if (blockCount == 1)
+		{
+			if (bStable)
+				std::stable_sort(data, data + count, comp);
+			else
+				std::sort(data, data + count, comp);
+
+			return;
+		}
+
+		RunBlocks(count, blockCount, [&](size_t, size_t start, size_t end) -> void
+		{
+			if (bStable)
+				std::stable_sort(data + start, data + end, comp);
+			else
+				std::sort(data + start, data + end, comp);
+		});
+
+		// run boundaries, run i is [runs[i], runs[i + 1])
+		std::vector<size_t> runs(blockCount + 1);
+		for (size_t i = 0; i <= blockCount; i++)
+			runs[i] = count * i / blockCount;
+
+		std::vector<T> buffer(count);
+		T* from = data;
+		T* to = buffer.data();
+
+		while (runs.size() > 2)
+		{
+			const size_t pairCount = (runs.size() - 1) / 2;
+			const bool bOddRun = (runs.size() - 1) % 2 == 1;
+
+			// split each pair's merge into enough pieces to keep every thread busy
+			size_t pieces = GetThreadCount() / pairCount;
+			if (pieces == 0) pieces = 1;
+
+			RunBlocks(pairCount * pieces, pairCount * pieces, [&](size_t task, size_t, size_t) -> void
+			{
+				const size_t pair = task / pieces;
+				const size_t piece = task % pieces;
+
+				const T* a = from + runs[pair * 2];
+				const T* b = from + runs[pair * 2 + 1];
+				const size_t aCount = runs[pair * 2 + 1] - runs[pair * 2];
+				const size_t bCount = runs[pair * 2 + 2] - runs[pair * 2 + 1];
+				const size_t total = aCount + bCount;
+
+				const size_t outStart = total * piece / pieces;
+				const size_t outEnd = total * (piece + 1) / pieces;
+				const size_t aStart = MergePathSplit(a, aCount, b, bCount, outStart, comp);
+				const size_t aEnd = MergePathSplit(a, aCount, b, bCount, outEnd, comp);
+
+				std::merge(
+					std::make_move_iterator(a + aStart), std::make_move_iterator(a + aEnd), 
+					std::make_move_iterator(b + (outStart - aStart)), std::make_move_iterator(b + (outEnd - aEnd)), 
+					to + runs[pair * 2] + outStart, comp);
+			});
+
+			if (bOddRun)
+			{
+				const size_t start = runs[runs.size() - 2];
+				std::move(from + start, from + count, to + start);
+			}
+
+			std::vector<size_t> merged;
+			for (size_t i = 0; i < runs.size(); i += 2)
+				merged.push_back(runs[i]);
+
+			if (merged.back() != count)
+				merged.push_back(count);
+
+			runs.swap(merged);
+			std::swap(from, to);
+		}
+
+		if (from != data)
+		{
+			RunBlocks(count, blockCount, [&](size_t, size_t start, size_t end) -> void
+			{
+				std::move(from + start, from + end, data + start);
+			});
+		}
 	}
 
-	template <typename Functor, typename T, typename... TArgs>
-	static void Iterate(Functor func, int poolSize, std::vector<T>& data, TArgs&&... args)
+	// number of elements from a among the first diagonal elements of merging a and b, ties go to a so the merge is stable
+	template <typename T, typename CompareFunctor>
+	static size_t MergePathSplit(const T* a, size_t aCount, const T* b, size_t bCount, size_t diagonal, CompareFunctor& comp)
 	{
-		Iterate(func, poolSize, data.data(), data.size(), std::forward<TArgs>(args)...);
+		size_t low = diagonal > bCount ? diagonal - bCount : 0;
+		size_t high = diagonal < aCount ? diagonal : aCount;
+
+		while (low < high)
+		{
+			const size_t mid = (low + high) / 2;
+			if (comp(b[diagonal - mid - 1], a[mid]))
+				high = mid;
+			else
+				low = mid + 1;
+		}
+
+		return low;
 	}
 
-	template <typename Functor, typename T, typename... TArgs>
-	static void Iterate(Functor func, int poolSize, T* data, size_t elementCount, TArgs&&... args)
+	// finds a match for FindFirst, or any match at all for AnyOf when bFirst is false
+	// returns the index of the match, count if there is none
+	template <typename T, typename PredicateFunctor>
+	size_t RunFind(const T* data, size_t count, PredicateFunctor& pred, const IterOptions& options, bool bFirst)
 	{
-		const auto iterCallback = [](KThreadPool* pool, Functor func, T* data, size_t i, TArgs... args) -> void
+		if (count == 0) return 0;
+
+		size_t runnerCount = GetThreadCount();
+		if (runnerCount > count) runnerCount = count;
+
+		size_t grainSize = options.GrainSize > 0 ? options.GrainSize : count / (runnerCount * 8);
+		if (grainSize == 0) grainSize = 1;
+
+		std::atomic<size_t> next { 0 };
+		std::atomic<size_t> found { count };
+
+		const auto runner = [&]() -> void
 		{
-			pool->IterCallback(func, data, i, std::forward<TArgs>(args)...);
+			while (true)
+			{
+				const size_t start = next.fetch_add(grainSize, std::memory_order_relaxed);
+				if (start >= count) return;
+
+				// nothing here can beat a match before this chunk, and for AnyOf any match will do
+				const size_t best = found.load(std::memory_order_relaxed);
+				if (bFirst ? best < start : best != count) return;
+				if (options.Cancel && options.Cancel->IsCancelled()) return;
+
+				const size_t end = count - start > grainSize ? start + grainSize : count;
+				for (size_t i = start; i < end; i++)
+				{
+					if (!pred(data[i])) continue;
+
+					size_t current = found.load(std::memory_order_relaxed);
+					while (i < current && !found.compare_exchange_weak(current, i, std::memory_order_relaxed)) {}
+					break;
+				}
+			}
 		};
 
-		typedef ThreadJob<decltype(iterCallback), KThreadPool*, Functor, T*, size_t, TArgs...> Job;
-		std::vector<Job> jobs;
-		jobs.reserve(elementCount);
+		RunOnPool(runnerCount, runner);
 
-		// thread pool needs to exist in its own scope so that it runs its destructor while jobs vector is still valid
-		//    because pool.PendingJobs holds pointers to the jobs vector in this function
-		// keeping them in the same scope would be fine but then jobs must be declared first so it runs destructor last
-		//    but im also not sure if the standard guarantees that destructor order
-		{
-			if (poolSize == 0) poolSize = GetCpuCoreCount();
-			if (poolSize > elementCount) poolSize = (int)elementCount;
-			KThreadPool pool(poolSize);
+		return found.load(std::memory_order_relaxed);
+	}
+
+	// moves the elements where pred is true to out, in order, followed by the rest if rest is set
+	// copies instead of moving unless bMove, a template parameter so move only types never see the copy
+	// returns how many pred was true for
+	template <bool bMove, typename T, typename PredicateFunctor>
+	size_t RunPartitionCopy(T* data, size_t count, PredicateFunctor& pred, T* out, bool bKeepRest)
+	{
+		const size_t blockCount = GetBlockCount(count);
+
+		// result of pred for every element and how many were true in each block
+		std::vector<uint8_t> flags(count);
+		std::vector<size_t> blockOffsets(blockCount);
 
-			for (size_t i = 0; i < elementCount; i++)
+		RunBlocks(count, blockCount, [&](size_t block, size_t start, size_t end) -> void
+		{
+			size_t selected = 0;
+			for (size_t i = start; i < end; i++)
 			{
-				jobs.push_back(Job(false, iterCallback, &pool, func, data, i, std::forward<TArgs>(args)...));
+				flags[i] = pred(data[i]) ? 1 : 0;
+				selected += flags[i];
 			}
 
+			blockOffsets[block] = selected;
+		});
+
+		size_t selectedTotal = 0;
+		for (size_t& blockOffset : blockOffsets)
+		{
+			const size_t selected = blockOffset;
+			blockOffset = selectedTotal;
+			selectedTotal += selected;
+		}
+
+		RunBlocks(count, blockCount, [&](size_t block, size_t start, size_t end) -> void
+		{
+			size_t selected = blockOffsets[block];
+
+			// the rest go after every selected element, in front of them in this block are start - selected unselected ones
+			size_t rest = selectedTotal + (start - blockOffsets[block]);
+
+			for (size_t i = start; i < end; i++)
 			{
-				// add pending jobs to be picked up by threads
-				std::lock_guard<std::mutex> lock(pool.QueueMutex);
-				pool.PendingJobs.reserve(elementCount);
-				for (Job& job : jobs)
-					pool.PendingJobs.push_back(&job);
+				T* target;
+				if (flags[i])
+					target = &out[selected++];
+				else if (bKeepRest)
+					target = &out[rest++];
+				else
+					continue;
+
+				if constexpr (bMove)
+					*target = std::move(data[i]);
+				else
+					*target = data[i];
 			}
-		}
+		});
+
+		return selectedTotal;
 	}
 
-	template <typename Functor, typename WeightFunctor, typename T, typename... TArgs>
-	static void IterateWeighted(Functor func, WeightFunctor weightFunc, int poolSize, std::vector<T>& data, TArgs&&... args)
+	// split into about sectionCount contiguous sections of equal total weight using the running total of the weights
+	// section boundaries are rounded to the nearest multiple of alignment
+	static void SplitWeighted(const std::vector<double>& prefix, size_t sectionCount, size_t alignment, std::vector<IterSection>& sections)
 	{
-		IterateWeighted(func, weightFunc, poolSize, data.data(), data.size(), std::forward<TArgs>(args)...);
+		const size_t count = prefix.size();
+		const double total = prefix[count - 1];
+		if (alignment == 0) alignment = 1;
+		if (sectionCount > (count + alignment - 1) / alignment) sectionCount = (count + alignment - 1) / alignment;
+
+		if (!(total > 0))
+		{
+			// no usable weights, fall back to equal element counts
+			size_t start = 0;
+			for (size_t i = 1; i <= sectionCount; i++)
+			{
+				const size_t end = i == sectionCount ? count : count * i / sectionCount / alignment * alignment;
+				if (end <= start) continue;
+
+				sections.push_back({ start, end, 0 });
+				start = end;
+			}
+
+			return;
+		}
+
+		sections.reserve(sectionCount);
+
+		size_t start = 0;
+		double startWeight = 0;
+		for (size_t k = 1; k < sectionCount; k++)
+		{
+			// first element whose running total reaches this boundary
+			const double target = total * k / sectionCount;
+			const size_t i = std::lower_bound(prefix.begin() + start, prefix.end(), target) - prefix.begin();
+			if (i >= count) break;
+
+			// end the section before or after that element, whichever lands closer to the boundary
+			const double before = i > 0 ? prefix[i - 1] : 0;
+			size_t end = target - before < prefix[i] - target ? i : i + 1;
+			end = (end + alignment / 2) / alignment * alignment;
+
+			// a single element heavier than several sections covers more than one boundary
+			if (end <= start) continue;
+			if (end >= count) break;
+
+			sections.push_back({ start, end, prefix[end - 1] - startWeight });
+			startWeight = prefix[end - 1];
+			start = end;
+		}
+
+		sections.push_back({ start, count, total - startWeight });
 	}
 
-	template <typename Functor, typename WeightFunctor, typename T, typename... TArgs>
-	static void IterateWeighted(Functor func, WeightFunctor weightFunc, int poolSize, T* data, size_t elementCount, TArgs&&... args)
+	// hands out the ranges of [0, Count) that Iterate runners work through
+	// with a ChunkAlignment everything below counts in aligned blocks instead of elements, the last block may be partial
+	struct IterClaim
 	{
-		typedef typename std::remove_pointer<T>::type type;
-		static_assert(std::is_invocable<WeightFunctor, type*>::value, "weight function must take a pointer to T as its only argument");
-		static_assert(std::is_same<double, decltype(weightFunc(std::declval<const type*>()))>::value, 
-			"weight function take a const pointer to object type and must return double");
+		size_t Count;
+		size_t RunnerCount;
+		size_t GrainSize;
+		EPartition Partition;
+
+		size_t Alignment;
+		size_t ElementCount;
+
+		const CancellationToken* Cancel;
 
-		// find total weight
-		double total = 0;
-		for (size_t i = 0; i < elementCount; i++)
+		// number of elements claimed so far, chunks are claimed from the end of the array toward the start
+		//    so the last objects are still iterated first
+		std::atomic<size_t> Claimed { 0 };
+
+		IterClaim(size_t count, size_t runnerCount, const IterOptions& options)
+			: Count(count), RunnerCount(runnerCount), GrainSize(options.GrainSize), Partition(options.Partition), 
+			Alignment(options.ChunkAlignment > 1 ? options.ChunkAlignment : 1), ElementCount(count), Cancel(options.Cancel)
 		{
-			if constexpr (std::is_pointer<T>::value)
-				total += weightFunc(data[i]);
-			else
-				total += weightFunc(&data[i]);
-		}
+			if (RunnerCount == 0) RunnerCount = 1;
 
-		if (poolSize == 0) poolSize = GetCpuCoreCount();
-		if (poolSize > elementCount) poolSize = (int)elementCount;
-		KThreadPool pool(poolSize);
+			if (Alignment > 1)
+			{
+				Count = (count + Alignment - 1) / Alignment;
+				GrainSize = (GrainSize + Alignment - 1) / Alignment;
+
+				// no runner without at least one block
+				if (RunnerCount > Count) RunnerCount = Count;
+			}
 
-		// get target weight for each thread to have an even workload
-		const double targetWeight = total / pool.Threads.size();
-		std::vector<IterSection> sections(pool.Threads.size());
+			if (GrainSize == 0)
+			{
+				// enough chunks per runner to even out small imbalances without claiming too often
+				GrainSize = Partition == EPartition::Guided ? 1 : Count / (RunnerCount * 8);
+				if (GrainSize == 0) GrainSize = 1;
+			}
+		}
 
-		double accumWeight = 0;
-		size_t sectionIndex = 0;
-		size_t newStart = 0;
-		for (size_t i = 0; i < elementCount; i++)
+		// gets the next range for a runner, returns false when there is nothing left or the loop was cancelled
+		bool Next(size_t& start, size_t& end)
 		{
-			double objWeight = 0;
+			if (Cancel && Cancel->IsCancelled()) return false;
 
-			if constexpr (std::is_pointer<T>::value)
-				objWeight = weightFunc(data[i]);
-			else
-				objWeight = weightFunc(&data[i]);
+			if (Partition == EPartition::Static)
+			{
+				// one range per runner, but whichever runner gets there first takes it
+				//    so the loop never waits on a runner that hasn't been scheduled yet
+				const size_t slot = Claimed.fetch_add(1, std::memory_order_relaxed);
+				if (slot >= RunnerCount) return false;
+
+				start = Count * slot / RunnerCount;
+				end = Count * (slot + 1) / RunnerCount;
+				ToElements(start, end);
+				return true;
+			}
+
+			size_t claimed = 0;
+			size_t chunk = GrainSize;
 
-			if (i < elementCount - 1 && accumWeight + objWeight <= targetWeight)
+			if (Partition == EPartition::Dynamic)
 			{
-				// has not exceeded target
-				accumWeight += objWeight;
+				claimed = Claimed.fetch_add(GrainSize, std::memory_order_relaxed);
+				if (claimed >= Count) return false;
 			}
 			else
 			{
-				// would put us over target, add and reset
-				sections[sectionIndex].Start = newStart;
-				sections[sectionIndex].End = i;
+				claimed = Claimed.load(std::memory_order_relaxed);
+				do
+				{
+					if (claimed >= Count) return false;
 
-				accumWeight = 0;
-				newStart = i + 1;
-				sectionIndex++;
+					const size_t guided = (Count - claimed) / (RunnerCount * 2);
+					chunk = guided > GrainSize ? guided : GrainSize;
+				} 
+				while (!Claimed.compare_exchange_weak(claimed, claimed + chunk, std::memory_order_relaxed));
 			}
+
+			if (chunk > Count - claimed) chunk = Count - claimed;
+
+			end = Count - claimed;
+			start = end - chunk;
+			ToElements(start, end);
+			return true;
 		}
 
-		const auto iterSection = [](KThreadPool* pool, Functor func, T* data, size_t start, size_t end, TArgs&&... args) -> void
+		void ToElements(size_t& start, size_t& end) const
 		{
-			for (size_t i = start; i < end; i++)
+			if (Alignment > 1)
 			{
-				pool->IterCallback(func, data, i, std::forward<TArgs>(args)...);
+				start *= Alignment;
+				end = end * Alignment < ElementCount ? end * Alignment : ElementCount;
 			}
-		};
+		}
+	};
 
-		for (const IterSection& section : sections)
+	// true for functors taking a span of elements and the index of the first one, rather than one element
+	// the element forms are checked first and the span form only if none of them match, since checking a generic lambda
+	//    with a deduced return type instantiates its body, and one written for elements doesn't compile with a span
+	// so a generic lambda meant for chunks has to take std::span<T> explicitly
+	template <typename Functor, typename T, typename... TArgs>
+	static constexpr bool IsSpanCallable()
+	{
+		typedef typename std::conditional<std::is_pointer<T>::value, T, T*>::type Element;
+
+		return std::conjunction<
+			std::negation<std::is_invocable<Functor, Element, size_t, Element, TArgs...>>,
+			std::negation<std::is_invocable<Functor, Element, size_t, TArgs...>>,
+			std::negation<std::is_invocable<Functor, Element, TArgs...>>,
+			std::is_invocable<Functor, std::span<T>, size_t, TArgs...>>::value;
+	}
+
+	// runs func over elements [start, end), the call form is picked once for the chunk instead of per element
+	//    so each branch is a plain loop the compiler can inline func into and vectorize
+	// a functor that takes a span and the index of its first element gets the whole chunk in one call instead
+	template <typename Functor, typename T, typename... TArgs>
+	static void IterChunk(Functor& func, T* data, size_t start, size_t end, TArgs&... args)
+	{
+		if constexpr (IsSpanCallable<Functor, T, TArgs...>())
+		{
+			func(std::span<T>(data + start, end - start), start, args...);
+		}
+		else if constexpr (std::is_pointer<T>::value)
+		{
+			if constexpr (std::is_invocable<Functor, T, size_t, T, TArgs...>::value)
+			{
+				for (size_t i = start; i < end; i++)
+					func(data[i], i, *data, args...);
+			}
+			else if constexpr (std::is_invocable<Functor, T, size_t, TArgs...>::value)
+			{
+				for (size_t i = start; i < end; i++)
+					func(data[i], i, args...);
+			}
+			else
+			{
+				for (size_t i = start; i < end; i++)
+					func(data[i], args...);
+			}
+		}
+		else
 		{
-			pool.AddFunctionToPool(iterSection, &pool, func, data, section.Start, section.End, std::forward<TArgs>(args)...);
+			if constexpr (std::is_invocable<Functor, T*, size_t, T*, TArgs...>::value)
+			{
+				for (size_t i = start; i < end; i++)
+					func(&data[i], i, data, args...);
+			}
+			else if constexpr (std::is_invocable<Functor, T*, size_t, TArgs...>::value)
+			{
+				for (size_t i = start; i < end; i++)
+					func(&data[i], i, args...);
+			}
+			else
+			{
+				for (size_t i = start; i < end; i++)
+					func(&data[i], args...);
+			}
 		}
 	}
 
-private: 
-
 	template <typename Functor, typename T, typename... TArgs>
-	void IterCallback(Functor func, T* data, size_t i, TArgs&&... args)
+	decltype(auto) IterCallback(Functor& func, T* data, size_t i, TArgs&&... args)
 	{
 		if constexpr (std::is_pointer<T>::value)
 		{
 			if constexpr (std::is_invocable<Functor, T, size_t, T, TArgs...>::value)
-				func(data[i], i, *data, std::forward<TArgs>(args)...);
+				return func(data[i], i, *data, std::forward<TArgs>(args)...);
 			else if constexpr (std::is_invocable<Functor, T, size_t, TArgs...>::value)
-				func(data[i], i, std::forward<TArgs>(args)...);
+				return func(data[i], i, std::forward<TArgs>(args)...);
 			else
-				func(data[i], std::forward<TArgs>(args)...);
+				return func(data[i], std::forward<TArgs>(args)...);
 		}
 		else
 		{
 			if constexpr (std::is_invocable<Functor, T*, size_t, T*, TArgs...>::value)
-				func(&data[i], i, data, std::forward<TArgs>(args)...);
+				return func(&data[i], i, data, std::forward<TArgs>(args)...);
 			else if constexpr (std::is_invocable<Functor, T*, size_t, TArgs...>::value)
-				func(&data[i], i, std::forward<TArgs>(args)...);
+				return func(&data[i], i, std::forward<TArgs>(args)...);
 			else
-				func(&data[i], std::forward<TArgs>(args)...);
+				return func(&data[i], std::forward<TArgs>(args)...);
 		}
 	}
 };
@@ -1,5 +1,6 @@
 #include "kthreadpool.hpp"
 #include <iostream>
+#include <stdexcept>
 
 #define OBJ_COUNT 256
 
@@ -39,7 +40,7 @@ struct Object
 	};
 };
 
-const int ThreadCount = KThreadPool::GetCpuCoreCount();
+const int ThreadCount = KThreadPool::GetAvailableCpuCount();
 
 std::vector<Object> Objects;
 std::vector<Object*> ObjectPtrs;
@@ -116,6 +117,18 @@ void Test_ObjIndexData()
 	END_TIMING();
 }
 
+void Test_ObjGuided()
+{
+	const auto iter = [](Object* obj) -> void
+	{
+		obj->LookBusy();
+	};
+
+	START_TIMING("Object Guided");
+	KThreadPool::Iterate(iter, { .Partition = KThreadPool::EPartition::Guided }, ThreadCount, Objects);
+	END_TIMING();
+}
+
 void TestWeighted_ObjPtr()
 {
 	const auto iter = [](Object* obj) -> void
@@ -212,6 +225,137 @@ void TestWeighted_ObjIndexData()
 	END_TIMING();
 }
 
+void Test_PoolParallelFor(KThreadPool& pool)
+{
+	const auto iter = [](Object* obj, size_t index) -> void
+	{
+		obj->LookBusy();
+	};
+
+	START_TIMING("Pool ParallelFor Object Index");
+	pool.ParallelFor(iter, Objects);
+	END_TIMING();
+}
+
+void Test_PoolParallelForSpan(KThreadPool& pool)
+{
+	const auto iter = [](std::span<Object> chunk, size_t baseIndex) -> void
+	{
+		for (Object& obj : chunk)
+			obj.LookBusy();
+	};
+
+	START_TIMING("Pool ParallelFor Object Span");
+	pool.ParallelFor(iter, { .ChunkAlignment = 8 }, Objects);
+	END_TIMING();
+}
+
+// generic lambdas written for one element must not be mistaken for the span form
+void Test_PoolParallelForGeneric(KThreadPool& pool)
+{
+	START_TIMING("Pool ParallelFor Object Generic");
+	pool.ParallelFor([](auto obj) -> void { obj->LookBusy(); }, Objects);
+	pool.ParallelFor([](auto obj, size_t index) -> void { obj->LookBusy(); }, ObjectPtrs);
+	END_TIMING();
+}
+
+void Test_PoolIterateAsync(KThreadPool& pool)
+{
+	const auto iter = [](Object* obj) -> void
+	{
+		obj->LookBusy();
+	};
+
+	START_TIMING("Pool IterateAsync Object");
+	KThreadPool::Future<void> loop = pool.IterateAsync(iter, Objects);
+	std::cout << "Loop started, " << (loop.IsReady() ? "already done\n" : "caller keeps going\n");
+	loop.Wait();
+	END_TIMING();
+}
+
+void Test_PoolReduce(KThreadPool& pool)
+{
+	const auto sum = [](int a, int b) -> int { return a + b; };
+	const auto value = [](Object* obj) -> int { return obj->Value; };
+
+	START_TIMING("Pool TransformReduce ObjectPtr");
+	const int result = pool.TransformReduce(ObjectPtrs, 0, sum, value);
+	std::cout << "Sum " << result << (result == OBJ_COUNT * (OBJ_COUNT - 1) / 2 ? " (correct)\n" : " (WRONG)\n");
+
+	// read only containers pass const elements
+	const std::vector<Object>& objects = Objects;
+	const int constResult = pool.TransformReduce(objects, 0, sum, [](const Object* obj) -> int { return obj->Value; });
+	std::cout << "Const sum " << constResult << (constResult == result ? " (correct)\n" : " (WRONG)\n");
+	END_TIMING();
+}
+
+void Test_PoolFindFirst(KThreadPool& pool)
+{
+	START_TIMING("Pool FindFirst Object");
+	const size_t index = pool.FindFirst(Objects, [](const Object& obj) -> bool 
+	{ 
+		return obj.Value >= OBJ_COUNT / 2; 
+	}, { .GrainSize = 16 });
+	std::cout << "Found " << index << (index == OBJ_COUNT / 2 ? " (correct)\n" : " (WRONG)\n");
+	END_TIMING();
+}
+
+void Test_PoolSort(KThreadPool& pool)
+{
+	std::vector<int> values(OBJ_COUNT);
+	for (int i = 0; i < OBJ_COUNT; i++)
+		values[i] = (i * 7919) % OBJ_COUNT;
+
+	START_TIMING("Pool Sort and InclusiveScan");
+	pool.Sort(values, std::greater<int>());
+	pool.InclusiveScan(values, [](int a, int b) -> int { return a + b; });
+	std::cout << "Sum " << values.back() << (values.back() == OBJ_COUNT * (OBJ_COUNT - 1) / 2 && values[0] == OBJ_COUNT - 1 ? " (correct)\n" : " (WRONG)\n");
+	END_TIMING();
+}
+
+void Test_PoolScratch(KThreadPool& pool)
+{
+	// the calling thread is -1, so it gets the first slot
+	std::vector<int> totals(pool.GetMaxThreadCount() + 1);
+
+	START_TIMING("Pool ParallelFor Scratch");
+	pool.ParallelFor([&pool, &totals](std::span<Object> chunk, size_t base) -> void
+	{
+		std::span<int> values = KThreadPool::GetScratchArena().AllocateSpan<int>(chunk.size());
+		for (size_t i = 0; i < chunk.size(); i++)
+			values[i] = chunk[i].Value;
+		for (int value : values)
+			totals[pool.CurrentWorkerIndex() + 1] += value;
+	}, Objects);
+	int sum = 0;
+	for (int total : totals)
+		sum += total;
+	std::cout << "Sum " << sum << (sum == OBJ_COUNT * (OBJ_COUNT - 1) / 2 ? " (correct)\n" : " (WRONG)\n");
+	END_TIMING();
+}
+
+void Test_PoolStablePartition(KThreadPool& pool)
+{
+	// move only elements, nothing may be copied
+	std::vector<std::unique_ptr<int>> values(OBJ_COUNT);
+	for (int i = 0; i < OBJ_COUNT; i++)
+		values[i] = std::make_unique<int>(i);
+
+	START_TIMING("Pool StablePartition unique_ptr");
+	const size_t even = pool.StablePartition(values, [](const std::unique_ptr<int>& value) -> bool { return *value % 2 == 0; });
+	const bool bCorrect = even == OBJ_COUNT / 2 && *values[1] == 2 && *values[even] == 1 && *values.back() == OBJ_COUNT - 1;
+	std::cout << "Even " << even << (bCorrect ? " (correct)\n" : " (WRONG)\n");
+	END_TIMING();
+}
+
+KThreadPool::Task<int> CoroutineSum(KThreadPool& pool)
+{
+	co_await pool.Schedule();
+	const int product = co_await pool.Submit([](int a, int b) -> int { return a * b; }, 6, 7);
+	co_await pool.IterateAsync([](Object* obj) -> void { obj->Value++; }, Objects);
+	co_return product + Objects.back().Value;
+}
+
 int main()
 {
 	Objects.resize(OBJ_COUNT);
@@ -230,6 +374,7 @@ int main()
 	Test_Obj();
 	Test_ObjIndex();
 	Test_ObjIndexData();
+	Test_ObjGuided();
 	TestWeighted_ObjPtr();
 	TestWeighted_ObjPtrIndex();
 	TestWeighted_ObjPtrIndexData();
@@ -238,6 +383,16 @@ int main()
 	TestWeighted_ObjIndexData();
 
 	KThreadPool pool(ThreadCount);
+	Test_PoolParallelFor(pool);
+	Test_PoolParallelForSpan(pool);
+	Test_PoolParallelForGeneric(pool);
+	Test_PoolIterateAsync(pool);
+	Test_PoolReduce(pool);
+	Test_PoolSort(pool);
+	Test_PoolStablePartition(pool);
+	Test_PoolFindFirst(pool);
+	Test_PoolScratch(pool);
+
 	const auto job = [](double time) -> void
 	{
 		std::this_thread::sleep_for(std::chrono::duration<double>(time));
@@ -248,5 +403,47 @@ int main()
 	pool.WaitForFinish();
 	std::cout << "Finished\n";
 
+	std::cout << "Submitting functions...\n";
+	KThreadPool::Future<int> product = pool.Submit([](int a, int b) -> int { return a * b; }, 6, 7);
+	KThreadPool::Future<int> next = product.Then([](int value) -> int { return value + 1; });
+	std::cout << "Result " << next.Get() << (next.IsValid() ? " (still valid)\n" : "\n");
+
+	std::cout << "Throwing from jobs...\n";
+	for (int i = 0; i < ThreadCount; i++)
+		pool.AddFunctionToPool([]() -> void { throw std::runtime_error("job failed"); });
+	try
+	{
+		pool.WaitForFinish();
+	}
+	catch (const KThreadPool::JobError& error)
+	{
+		std::cout << "Caught " << error.Count << (error.Count == (size_t)ThreadCount ? " (correct)\n" : " (WRONG)\n");
+	}
+
+	std::cout << "Running coroutine...\n";
+	const int coroutineResult = CoroutineSum(pool).Get();
+	std::cout << "Result " << coroutineResult << (coroutineResult == 42 + OBJ_COUNT ? " (correct)\n" : " (WRONG)\n");
+
+	std::cout << "Running task graph...\n";
+	KThreadPool::TaskGraph graph;
+	const KThreadPool::TaskGraph::TaskId first = graph.AddTask(job, 0.5);
+	const KThreadPool::TaskGraph::TaskId second = graph.AddTask(job, 0.5);
+	const KThreadPool::TaskGraph::TaskId last = graph.AddTask([]() -> void { std::cout << "Both stages finished\n"; });
+	graph.AddDependency(first, last);
+	graph.AddDependency(second, last);
+	pool.RunGraph(graph);
+
+#ifdef KTHREADPOOL_STATS
+	const KThreadPool::PoolStats stats = pool.GetStats();
+	for (size_t i = 0; i < stats.Workers.size(); i++)
+		std::cout << "Thread " << i << " ran " << stats.Workers[i].ExecutedJobs << " jobs, stole " << stats.Workers[i].StolenJobs << ", idle " << stats.Workers[i].IdleSeconds << "s\n";
+	std::cout << "Median queue latency " << KThreadPool::PoolStats::Percentile(stats.QueueLatency, 0.5) << "s\n";
+#endif
+
+#ifdef KTHREADPOOL_TRACE
+	if (pool.DumpTrace("kthread_trace.json"))
+		std::cout << "Trace written to kthread_trace.json\n";
+#endif
+
 	return 0;
 }